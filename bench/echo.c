@@ -0,0 +1,177 @@
+/*
+ * Echo benchmark over loopback TCP, to compare the event backends.
+ *
+ * The main thread runs an echo server on the main reactor; a client thread
+ * keeps nr_conns connections busy with msg_size byte round trips for the
+ * given number of seconds.  Built by "make bench".
+ *
+ *   usage: echo [epoll|uring] [nr_conns] [msg_size] [seconds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "event.h"
+
+#define MAX_MSG_SIZE	4096
+
+static int nr_conns = 64;
+static int msg_size = 64;
+static int seconds = 5;
+static int port;
+
+static uint64_t nr_round_trips;
+
+static uint64_t get_msec_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void echo_handler(int fd, int events, void *data)
+{
+	char buf[MAX_MSG_SIZE];
+	ssize_t ret;
+
+	ret = read(fd, buf, sizeof(buf));
+	if (ret <= 0) {
+		unregister_event(fd);
+		close(fd);
+		return;
+	}
+
+	if (xwrite(fd, buf, ret) != ret)
+		bs_err("failed to echo: %m");
+}
+
+static void echo_accept(int listen_fd, int fd, void *data)
+{
+	int on = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if (register_event(fd, echo_handler, NULL) < 0) {
+		bs_err("failed to register connection: %m");
+		close(fd);
+	}
+}
+
+static int echo_listen(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		panic("failed to create socket: %m");
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0 ||
+	    getsockname(fd, (struct sockaddr *)&sin, &len) < 0)
+		panic("failed to listen: %m");
+	port = ntohs(sin.sin_port);
+
+	if (register_accept_event(fd, echo_accept, NULL) < 0)
+		panic("failed to register listener: %m");
+
+	return fd;
+}
+
+static int echo_connect(void)
+{
+	struct sockaddr_in sin;
+	int fd, on = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		panic("failed to create socket: %m");
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+		panic("failed to connect: %m");
+
+	return fd;
+}
+
+/* Sends a message on every connection, then waits for all the echoes */
+static void *client_thread(void *arg)
+{
+	char buf[MAX_MSG_SIZE];
+	int *fds, i;
+
+	fds = xcalloc(nr_conns, sizeof(*fds));
+	for (i = 0; i < nr_conns; i++)
+		fds[i] = echo_connect();
+
+	memset(buf, 'x', msg_size);
+	for (;;) {
+		for (i = 0; i < nr_conns; i++)
+			if (xwrite(fds[i], buf, msg_size) != msg_size)
+				panic("failed to send: %m");
+		for (i = 0; i < nr_conns; i++)
+			if (xread(fds[i], buf, msg_size) != msg_size)
+				panic("failed to receive: %m");
+		uatomic_add(&nr_round_trips, nr_conns);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	enum event_backend backend = EVENT_BACKEND_EPOLL;
+	uint64_t start, end;
+	pthread_t client;
+
+	if (argc > 1 && !strcmp(argv[1], "uring"))
+		backend = EVENT_BACKEND_URING;
+	else if (argc > 1 && strcmp(argv[1], "epoll")) {
+		fprintf(stderr,
+			"usage: %s [epoll|uring] [nr_conns] [msg_size] [seconds]\n",
+			argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		nr_conns = max(atoi(argv[2]), 1);
+	if (argc > 3)
+		msg_size = min(max(atoi(argv[3]), 1), MAX_MSG_SIZE);
+	if (argc > 4)
+		seconds = max(atoi(argv[4]), 1);
+
+	if (init_event_backend(nr_conns + 64, backend) < 0)
+		panic("failed to initialize the event loop");
+	echo_listen();
+
+	if (pthread_create(&client, NULL, client_thread, NULL))
+		panic("failed to create the client thread");
+
+	start = get_msec_time();
+	do {
+		event_loop(10);
+		end = get_msec_time();
+	} while (end - start < seconds * 1000ULL);
+
+	printf("%s: %d connections, %d bytes: %.0f round trips/s\n",
+	       event_backend_name(), nr_conns, msg_size,
+	       uatomic_read(&nr_round_trips) * 1000.0 / (end - start));
+
+	/* the client may be blocked on an echo the server no longer sends */
+	fflush(stdout);
+	_exit(0);
+}
@@ -37,5 +37,12 @@
 #define likely(x)       __builtin_expect(!!(x), 1)
 #define unlikely(x)     __builtin_expect(!!(x), 0)
 
+#define noinline	__attribute__((noinline))
+
+#define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2*!!(condition)]))
+
+#define CACHELINE_SIZE	64
+#define __cacheline_aligned	__attribute__((aligned(CACHELINE_SIZE)))
+
 
 #endif	/* SD_COMPILER_H */
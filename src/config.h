@@ -4,4 +4,8 @@
 #include <unistd.h>
 /* syscall */
 
+#ifndef SIZEOF_LONG
+#define SIZEOF_LONG __SIZEOF_LONG__
+#endif
+
 #endif
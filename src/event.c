@@ -3,81 +3,728 @@
 #include <stdint.h>
 #include <time.h>
 #include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
 
-#include "rbtree.h"
 #include "util.h"
+#include "uring.h"
+#include "histogram.h"
 #include "event.h"
+#include "net.h"
 
-static int efd;
-static struct rb_root events_tree = RB_ROOT;
-static struct bs_rw_lock events_lock = BS_RW_LOCK_INITIALIZER;
+struct reactor;
+struct event_info;
+
+/* epoll busy poll parameters, from linux/eventpoll.h of Linux 6.9 */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+
+#define EPOLL_IOC_TYPE 0x8A
+#define EPIOCSPARAMS _IOW(EPOLL_IOC_TYPE, 0x01, struct epoll_params)
+#endif
+
+/*
+ * A backend delivers readiness of registered fds to its reactor.  Event masks
+ * passed to add and mod are in epoll format whatever the backend is.
+ */
+struct event_backend_ops {
+	const char *name;
+	int (*init)(struct reactor *r, int nr);
+	void (*exit)(struct reactor *r);
+	int (*add)(struct reactor *r, struct event_info *ei);
+	int (*mod)(struct reactor *r, struct event_info *ei);
+	int (*rearm)(struct reactor *r, struct event_info *ei);
+	int (*del)(struct reactor *r, struct event_info *ei);
+	/* wait up to timeout ms, then dispatch inside event_read_lock() */
+	int (*wait)(struct reactor *r, int timeout);
+	void (*dispatch)(struct reactor *r, int nr);
+	/* optional, called inside event_read_lock() once all handlers ran */
+	void (*flush)(struct reactor *r);
+	/* optional, let the kernel busy poll the NAPI contexts of the fds */
+	int (*busy_poll)(struct reactor *r, unsigned int usec,
+			 unsigned int budget);
+	/* completions carry the accepted fd, see reactor_dispatch() */
+	bool accepts;
+};
+
+/* epoll format events pending dispatch, identified by registration tag */
+struct event_vec {
+	struct epoll_event *ev;
+	int nr;
+	int size;
+};
+
+enum {
+	EVENT_PRIO_CLASS_HIGH,
+	EVENT_PRIO_CLASS_NORMAL,
+	EVENT_PRIO_CLASS_LOW,
+	EVENT_NR_PRIO,
+};
+
+/*
+ * Every reactor owns an epoll instance and its event array, and is driven by
+ * exactly one thread.  The main reactor is set up by init_event() and run by
+ * whoever calls event_loop(); the others get a dedicated thread each.
+ */
+struct reactor {
+	int idx;
+	int cpu;
+	pthread_t thread;
+	const struct event_backend_ops *ops;
+
+	/*
+	 * epoll backend.  The event array grows while waits fill it up and
+	 * shrinks back towards min_events while they leave most of it unused.
+	 */
+	int efd;
+	struct epoll_event *events;
+	int nr_events;
+	int min_events;
+	int max_events;
+	int nr_sparse_waits;
+
+	/*
+	 * io_uring backend, sq_lock serializes producers of submissions.
+	 * Single shot polls completed in an iteration are re-armed once their
+	 * handlers have run, see uring_flush().
+	 */
+	struct uring ring;
+	struct bs_mutex sq_lock;
+	struct event_vec rearm;
+
+	/*
+	 * fds whose handler returned before draining them, dispatched again
+	 * without waiting for the kernel.  Only touched by the reactor thread.
+	 */
+	struct epoll_event *ready;
+	int nr_ready;
+	int ready_size;
+	/* the other half of the double buffer, see reactor_loop() */
+	struct epoll_event *ready_spare;
+	int spare_size;
+
+	/*
+	 * While some registration of this reactor has a priority other than
+	 * normal or a dispatch budget is set, events are sorted by class and
+	 * dispatched highest class first, up to budget per iteration.
+	 */
+	struct event_vec sorted[EVENT_NR_PRIO];
+	bool sorting;
+	int nr_prio_regs;
+	unsigned int budget;
+
+	/*
+	 * Spin on non-blocking polls for spin_usec before blocking, trading a
+	 * core for the wakeup latency.  busy_poll_usec is applied to the
+	 * sockets registered to this reactor as SO_BUSY_POLL.
+	 */
+	unsigned int spin_usec;
+	unsigned int busy_poll_usec;
+
+	/* updated by the reactor thread only */
+	uint64_t spin_wakeups;
+	uint64_t block_wakeups;
+	/* events per wait, recorded while event stats are enabled */
+	struct histogram batch_hist;
+
+	/* min-heap of armed timers ordered by expiry, see add_event_timer() */
+	struct event_timer **timers;
+	int nr_timers;
+	int timers_size;
+
+	/* tasks injected by other threads, see event_post() */
+	struct event_post_ring *post;
+	int post_efd;
+};
+
+#define MAX_REACTORS 256
+
+/* bounds of the epoll batch auto tuning, see epoll_tune_batch() */
+#define EVENT_BATCH_MAX		1024
+#define EVENT_BATCH_SHRINK	64
+
+static const struct event_backend_ops epoll_ops, uring_ops;
+/* the backend of the main reactor, used by all the others as well */
+static const struct event_backend_ops *event_ops = &epoll_ops;
+
+static struct reactor main_reactor = { .efd = -1, .cpu = -1 };
+static struct reactor *reactors[MAX_REACTORS] = { &main_reactor };
+static int nr_reactors = 1;
+static struct bs_mutex reactors_lock = BS_MUTEX_INITIALIZER;
+
+/*
+ * A bounded MPSC ring of posted tasks.  Each slot carries a sequence number
+ * telling producers whether it is free for the lap they are in and the
+ * consumer whether it has been filled (Vyukov's bounded queue, with a single
+ * consumer).
+ */
+#define EVENT_POST_RING_SIZE	4096
+#define EVENT_POST_BATCH	256
+
+struct event_post_slot {
+	uint64_t seq;
+	void (*fn)(void *arg);
+	void *arg;
+};
+
+struct event_post_ring {
+	uint64_t tail __cacheline_aligned;	/* next slot to claim */
+	/* the consumer is about to block and wants an eventfd write */
+	bool idle __cacheline_aligned;
+	uint64_t head __cacheline_aligned;	/* next slot to consume */
+	struct event_post_slot slots[EVENT_POST_RING_SIZE];
+};
+
+/* the reactor driven by the calling thread */
+static __thread struct reactor *current_reactor;
+
+/*
+ * Memory which a concurrent reader might still reference is not freed
+ * immediately but put on a limbo list, see event_retire().
+ */
+struct event_defer {
+	struct event_defer *next;
+	void *ptr;
+	/* frees ptr, plain free() if NULL */
+	void (*release)(void *ptr);
+};
+
+/*
+ * Dispatch statistics of a registration, allocated by its reactor on the
+ * first dispatch after enable_event_stats().  Handler runtime is measured
+ * in nanoseconds of CLOCK_MONOTONIC_RAW.
+ */
+struct event_stats {
+	struct histogram runtime;
+};
+
+static bool event_stats_enabled;
 
 struct event_info {
 	event_handler_t handler;
+	accept_handler_t accept;
 	int fd;
+	uint32_t gen;
 	void *data;
-	struct rb_node rb;
+	unsigned int flags;
+	int prio;
+	/* epoll format mask the backend has been asked to watch */
+	unsigned int events;
+	struct reactor *r;
+	struct event_stats *stats;
+	struct event_defer defer;
 };
 
-static struct epoll_event *events;
-static int nr_events;
+static void free_event_info(void *ptr)
+{
+	struct event_info *ei = ptr;
+
+	free(ei->stats);
+	free(ei);
+}
+
+/*
+ * The kernel and the ready lists identify a registration by its fd and a
+ * generation number, never by pointer.  An event whose generation doesn't
+ * match the current registration of the fd belongs to an unregistered one,
+ * possibly replaced by a new registration of the same fd number, and is
+ * skipped by the dispatcher.  So the rest of a batch can always be
+ * dispatched even when handlers unregister fds in the middle of it.
+ */
+static uint32_t event_gen;	/* protected by events_lock */
 
-static int event_cmp(const struct event_info *e1, const struct event_info *e2)
+static inline uint64_t event_tag(const struct event_info *ei)
 {
-	return intcmp(e1->fd, e2->fd);
+	return (uint64_t)ei->gen << 32 | (uint32_t)ei->fd;
 }
 
-int init_event(int nr)
+static inline int event_tag_fd(uint64_t tag)
+{
+	return (int)(uint32_t)tag;
+}
+
+static inline uint32_t event_tag_gen(uint64_t tag)
+{
+	return tag >> 32;
+}
+
+/*
+ * The registry is an array of event_info pointers indexed by fd.  Readers
+ * look it up without any lock; updaters are serialized by events_lock and
+ * publish a bigger copy of the table when an fd doesn't fit in it.
+ *
+ * fds are unique process-wide, so all reactors share the table and every
+ * entry records the reactor which owns it.  A reactor only ever dispatches
+ * the fds registered to its own epoll instance.
+ */
+struct event_table {
+	struct event_defer defer;
+	int nr;
+	struct event_info *slots[];
+};
+
+#define EVENT_TABLE_MIN_SIZE 1024
+
+static struct event_table empty_table = { .nr = 0 };
+static struct event_table *events_table = &empty_table;
+static struct bs_mutex events_lock = BS_MUTEX_INITIALIZER;
+
+/*
+ * Epoch based reclamation
+ *
+ * A reader publishes the global epoch it started with in its per-thread
+ * record.  The epoch can only advance when every active reader has seen the
+ * current one, so memory retired in epoch N is unreachable once the global
+ * epoch reaches N + 2.  Readers never wait for updaters and vice versa.
+ */
+#define EVENT_NR_EPOCHS 3
+
+struct event_reader {
+	unsigned long state;	/* (epoch << 1) | active */
+	int nesting;
+	struct event_reader *next;
+};
+
+static unsigned long global_epoch = 1;
+static struct event_reader *event_readers;
+static __thread struct event_reader *this_reader;
+
+/* protected by events_lock */
+static struct event_defer *limbo[EVENT_NR_EPOCHS];
+static int nr_limbo;
+
+static struct event_reader *get_event_reader(void)
+{
+	struct event_reader *r = this_reader, *head;
+
+	if (likely(r))
+		return r;
+
+	/* records are never freed, an exited thread just stays inactive */
+	r = xcalloc(1, sizeof(*r));
+	do {
+		head = uatomic_read(&event_readers);
+		r->next = head;
+	} while (uatomic_cmpxchg(&event_readers, head, r) != head);
+	this_reader = r;
+
+	return r;
+}
+
+static void event_read_lock(void)
+{
+	struct event_reader *r = get_event_reader();
+
+	if (r->nesting++ == 0) {
+		uatomic_set(&r->state, (uatomic_read(&global_epoch) << 1) | 1);
+		smp_mb();
+	}
+}
+
+static void event_read_unlock(void)
+{
+	struct event_reader *r = this_reader;
+
+	if (--r->nesting == 0)
+		uatomic_set(&r->state, 0);
+}
+
+/* Must be called with events_lock held */
+static bool event_epoch_advance(void)
+{
+	unsigned long epoch = uatomic_read(&global_epoch), state;
+	struct event_reader *r;
+
+	for (r = uatomic_read(&event_readers); r; r = r->next) {
+		state = uatomic_read(&r->state);
+		if ((state & 1) && (state >> 1) != epoch)
+			return false;
+	}
+	uatomic_set(&global_epoch, epoch + 1);
+
+	return true;
+}
+
+/* Must be called with events_lock held */
+static void event_reclaim(void)
+{
+	struct event_defer *d, *next;
+	unsigned long epoch;
+	int i;
+
+	for (i = 0; i < EVENT_NR_EPOCHS - 1 && nr_limbo; i++) {
+		if (!event_epoch_advance())
+			return;
+
+		/* the bucket of the epoch two steps behind the new one */
+		epoch = uatomic_read(&global_epoch);
+		d = limbo[(epoch + 1) % EVENT_NR_EPOCHS];
+		limbo[(epoch + 1) % EVENT_NR_EPOCHS] = NULL;
+		for (; d; d = next) {
+			next = d->next;
+			if (d->release)
+				d->release(d->ptr);
+			else
+				free(d->ptr);
+			uatomic_dec(&nr_limbo);
+		}
+	}
+}
+
+/* Must be called with events_lock held, after ptr has been unpublished */
+static void event_retire(struct event_defer *d, void *ptr)
+{
+	unsigned long epoch = uatomic_read(&global_epoch);
+
+	d->ptr = ptr;
+	d->next = limbo[epoch % EVENT_NR_EPOCHS];
+	limbo[epoch % EVENT_NR_EPOCHS] = d;
+	uatomic_inc(&nr_limbo);
+
+	event_reclaim();
+}
+
+static void post_handler(int fd, int events, void *data)
+{
+	/* only a wakeup, the ring is drained by every reactor_loop() */
+	eventfd_xread(fd);
+}
+
+static int init_reactor(struct reactor *r, int nr)
 {
-	nr_events = nr;
-	events = (struct epoll_event *)xcalloc(nr_events, sizeof(struct epoll_event));
+	struct event_post_ring *ring;
+	int i;
 
-	efd = epoll_create(nr);
-	if (efd < 0) {
+	r->ops = event_ops;
+	if (r->ops->init(r, nr) < 0)
 		return -1;
+
+	/* the producer and consumer cursors sit on cache lines of their own */
+	if (posix_memalign((void **)&ring, CACHELINE_SIZE, sizeof(*ring)))
+		panic("Out of memory");
+	memset(ring, 0, sizeof(*ring));
+	for (i = 0; i < EVENT_POST_RING_SIZE; i++)
+		ring->slots[i].seq = i;
+	r->post = ring;
+
+	r->post_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->post_efd < 0)
+		goto err;
+	if (register_event_on(r, r->post_efd, post_handler, NULL, EVENT_IN) < 0) {
+		close(r->post_efd);
+		goto err;
 	}
 
 	return 0;
+err:
+	free(r->post);
+	r->ops->exit(r);
+	return -1;
 }
 
-static struct event_info* lookup_event(int fd)
+static void exit_reactor(struct reactor *r)
 {
-	struct event_info key = { .fd = fd };
-	struct event_info *ret;
+	int i;
 
-	bs_read_lock(&events_lock);
-	ret = rb_search(&events_tree, &key, rb, event_cmp);
-	bs_rw_unlock(&events_lock);
+	for (i = 0; i < EVENT_NR_PRIO; i++)
+		free(r->sorted[i].ev);
+	unregister_event(r->post_efd);
+	close(r->post_efd);
+	free(r->post);
+	r->ops->exit(r);
+}
 
-	return ret;
+/*
+ * Set up the main reactor with the given backend.  Falls back to epoll when
+ * the kernel lacks what the io_uring backend needs.
+ */
+int init_event_backend(int nr, enum event_backend backend)
+{
+	if (backend == EVENT_BACKEND_URING) {
+		event_ops = &uring_ops;
+		if (init_reactor(&main_reactor, nr) == 0)
+			return 0;
+		bs_warn("io_uring is not available (%m), fall back to epoll");
+	}
+
+	event_ops = &epoll_ops;
+	return init_reactor(&main_reactor, nr);
 }
 
-int register_event(int fd, event_handler_t h, void *data)
+int init_event(int nr)
+{
+	return init_event_backend(nr, EVENT_BACKEND_EPOLL);
+}
+
+const char *event_backend_name(void)
+{
+	return event_ops->name;
+}
+
+static struct reactor *this_reactor(void)
+{
+	return current_reactor ? current_reactor : &main_reactor;
+}
+
+static void *reactor_routine(void *arg)
 {
+	struct reactor *r = arg;
+	cpu_set_t set;
+
+	if (r->cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(r->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			bs_warn("failed to pin reactor %d to cpu %d", r->idx,
+				r->cpu);
+	}
+
+	while (true)
+		reactor_loop(r, -1);
+
+	pthread_exit(NULL);
+}
+
+/*
+ * Create a reactor with its own epoll instance, or io_uring, of nr events and
+ * start a thread driving it.  The thread is pinned to cpu unless cpu is
+ * negative.
+ */
+struct reactor *create_reactor(int cpu, int nr)
+{
+	struct reactor *r;
 	int ret;
-	struct epoll_event ev;
+
+	r = xcalloc(1, sizeof(*r));
+	r->cpu = cpu;
+	if (init_reactor(r, nr) < 0) {
+		bs_err("failed to create %s instance: %m", event_ops->name);
+		free(r);
+		return NULL;
+	}
+
+	bs_mutex_lock(&reactors_lock);
+	if (nr_reactors == MAX_REACTORS) {
+		bs_mutex_unlock(&reactors_lock);
+		bs_err("too many reactors");
+		goto err;
+	}
+	r->idx = nr_reactors;
+
+	ret = pthread_create(&r->thread, NULL, reactor_routine, r);
+	if (ret) {
+		bs_mutex_unlock(&reactors_lock);
+		bs_err("failed to create reactor thread: %s", strerror(ret));
+		goto err;
+	}
+	reactors[r->idx] = r;
+	uatomic_inc(&nr_reactors);
+	bs_mutex_unlock(&reactors_lock);
+
+	return r;
+err:
+	exit_reactor(r);
+	free(r);
+	return NULL;
+}
+
+int get_nr_reactors(void)
+{
+	return uatomic_read(&nr_reactors);
+}
+
+struct reactor *get_reactor(int idx)
+{
+	if (idx < 0 || idx >= get_nr_reactors())
+		return NULL;
+
+	return reactors[idx];
+}
+
+/* Map a placement hint, e.g. a connection id or a hash, to a reactor */
+struct reactor *pick_reactor(unsigned int hint)
+{
+	return reactors[hint % get_nr_reactors()];
+}
+
+/* Must be called inside event_read_lock() or with events_lock held */
+static struct event_info *lookup_event(int fd)
+{
+	struct event_table *t = smp_load_acquire(&events_table);
+
+	if (unlikely(fd < 0 || fd >= t->nr))
+		return NULL;
+
+	return smp_load_acquire(&t->slots[fd]);
+}
+
+/* Must be called with events_lock held */
+static void event_table_set(int fd, struct event_info *ei)
+{
+	struct event_table *old = events_table, *new;
+	int nr;
+
+	if (fd >= old->nr) {
+		nr = max(old->nr, EVENT_TABLE_MIN_SIZE);
+		while (nr <= fd)
+			nr *= 2;
+
+		new = xcalloc(1, sizeof(*new) + nr * sizeof(new->slots[0]));
+		new->nr = nr;
+		memcpy(new->slots, old->slots, old->nr * sizeof(old->slots[0]));
+		smp_store_release(&events_table, new);
+
+		if (old != &empty_table)
+			event_retire(&old->defer, old);
+	}
+
+	smp_store_release(&events_table->slots[fd], ei);
+}
+
+static unsigned int event_flags_to_epoll(unsigned int flags)
+{
+	unsigned int events = 0;
+
+	if (flags & EVENT_IN)
+		events |= EPOLLIN;
+	if (flags & EVENT_OUT)
+		events |= EPOLLOUT;
+	if (flags & EVENT_ET)
+		events |= EPOLLET;
+	if (flags & EVENT_ONESHOT)
+		events |= EPOLLONESHOT;
+	if (flags & EVENT_EXCLUSIVE)
+		events |= EPOLLEXCLUSIVE;
+
+	return events;
+}
+
+static int __register_event(struct reactor *r, struct event_info *ei)
+{
+	int ret;
+
+	bs_mutex_lock(&events_lock);
+	if (lookup_event(ei->fd)) {
+		bs_mutex_unlock(&events_lock);
+		free(ei);
+		errno = EEXIST;
+		return -1;
+	}
+	/* generation 0 tags the backend's internal requests */
+	if (unlikely(++event_gen == 0))
+		++event_gen;
+	ei->gen = event_gen;
+
+	/* fails for non-socket fds and without CAP_NET_ADMIN; not fatal */
+	if (r->busy_poll_usec)
+		setsockopt(ei->fd, SOL_SOCKET, SO_BUSY_POLL, &r->busy_poll_usec,
+			   sizeof(r->busy_poll_usec));
+
+	/* publish first so that the very first event finds its handler */
+	event_table_set(ei->fd, ei);
+	ret = r->ops->add(r, ei);
+	if (ret) {
+		event_table_set(ei->fd, NULL);
+		ei->defer.release = free_event_info;
+		event_retire(&ei->defer, ei);
+	} else if (ei->prio != EVENT_PRIO_CLASS_NORMAL)
+		uatomic_inc(&r->nr_prio_regs);
+	bs_mutex_unlock(&events_lock);
+
+	return ret;
+}
+
+int register_event_on(struct reactor *r, int fd, event_handler_t h,
+		      void *data, unsigned int flags)
+{
 	struct event_info *ei;
 
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	/* the kernel refuses EPOLLEXCLUSIVE together with EPOLLONESHOT */
+	if ((flags & EVENT_EXCLUSIVE) && (flags & EVENT_ONESHOT)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((flags & EVENT_PRIO_HIGH) && (flags & EVENT_PRIO_LOW)) {
+		errno = EINVAL;
+		return -1;
+	}
+
 	ei = xcalloc(1, sizeof(*ei));
 	ei->fd = fd;
 	ei->handler = h;
 	ei->data = data;
+	ei->flags = flags;
+	if (flags & EVENT_PRIO_HIGH)
+		ei->prio = EVENT_PRIO_CLASS_HIGH;
+	else if (flags & EVENT_PRIO_LOW)
+		ei->prio = EVENT_PRIO_CLASS_LOW;
+	else
+		ei->prio = EVENT_PRIO_CLASS_NORMAL;
+	ei->events = event_flags_to_epoll(flags);
+	ei->r = r;
 
-	memset(&ev, 0, sizeof(ev));
-	ev.events = EPOLLIN;
-	ev.data.ptr = ei;
+	return __register_event(r, ei);
+}
 
-	ret = epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
-	if (ret) {
-		free(ei);
-	} else {
-		bs_write_lock(&events_lock);
-		rb_insert(&events_tree, ei, rb, event_cmp);
-		bs_rw_unlock(&events_lock);
+/*
+ * Register a listening socket.  h is called with every accepted connection;
+ * the io_uring backend accepts them with a single multishot request, epoll
+ * calls accept4() on each readiness notification.
+ */
+int register_accept_event(int fd, accept_handler_t h, void *data)
+{
+	struct reactor *r = this_reactor();
+	struct event_info *ei;
+
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
 	}
 
-	return ret;
+	ei = xcalloc(1, sizeof(*ei));
+	ei->fd = fd;
+	ei->accept = h;
+	ei->data = data;
+	ei->flags = EVENT_IN;
+	ei->prio = EVENT_PRIO_CLASS_NORMAL;
+	ei->events = EPOLLIN;
+	ei->r = r;
+
+	return __register_event(r, ei);
+}
+
+/*
+ * Register fd to the reactor of the calling thread, so that connections
+ * accepted by a reactor are served by the same one.  Other threads register
+ * to the main reactor.
+ */
+int register_event_ex(int fd, event_handler_t h, void *data,
+		      unsigned int flags)
+{
+	return register_event_on(this_reactor(), fd, h, data, flags);
+}
+
+int register_event(int fd, event_handler_t h, void *data)
+{
+	return register_event_ex(fd, h, data, EVENT_IN);
 }
 
 void unregister_event(int fd)
@@ -85,43 +732,47 @@ void unregister_event(int fd)
 	int ret;
 	struct event_info *ei;
 
+	bs_mutex_lock(&events_lock);
 	ei = lookup_event(fd);
-	if (!ei)
+	if (!ei) {
+		bs_mutex_unlock(&events_lock);
 		return;
+	}
 
-	ret = epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL);
+	ret = ei->r->ops->del(ei->r, ei);
 	if (ret)
 		printf("failed to delete epoll event for fd %d", fd);
-
-	bs_write_lock(&events_lock);
-	rb_erase(&ei->rb, &events_tree);
-	bs_rw_unlock(&events_lock);
-	free(ei);
+	if (ei->prio != EVENT_PRIO_CLASS_NORMAL)
+		uatomic_dec(&ei->r->nr_prio_regs);
 
 	/*
-	 * Although ei is no longer valid pointer, ei->handler() might be about
-	 * to be called in do_event_loop().  Refreshing the event loop is safe.
+	 * Handlers running on other threads may still use ei, so it is freed
+	 * once they have left their epoch.  Events of this registration left
+	 * in a batch fail the generation check.
 	 */
-	event_force_refresh();
+	event_table_set(fd, NULL);
+	ei->defer.release = free_event_info;
+	event_retire(&ei->defer, ei);
+	bs_mutex_unlock(&events_lock);
 }
 
 int modify_event(int fd, unsigned int new_events)
 {
 	int ret;
-	struct epoll_event ev;
 	struct event_info *ei;
 
+	/* serialized with update_event(), which modifies ei->events too */
+	bs_mutex_lock(&events_lock);
 	ei = lookup_event(fd);
 	if (!ei) {
+		bs_mutex_unlock(&events_lock);
 		bs_debug("event info for fd %d not found", fd);
 		return -1;
 	}
 
-	memset(&ev, 0, sizeof(ev));
-	ev.events = new_events;
-	ev.data.ptr = ei;
-
-	ret = epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev);
+	uatomic_set(&ei->events, new_events);
+	ret = ei->r->ops->mod(ei->r, ei);
+	bs_mutex_unlock(&events_lock);
 	if (ret) {
 		bs_debug("failed to delete epoll event for fd %d: %m", fd);
 		return -1;
@@ -129,35 +780,1190 @@ int modify_event(int fd, unsigned int new_events)
 	return 0;
 }
 
-static bool event_loop_refresh;
-
-void event_force_refresh(void)
+/*
+ * Set and clear EVENT_* flags of a registration, e.g. EVENT_OUT while a
+ * connection has pending output.  EVENT_EXCLUSIVE registrations can't be
+ * modified; the kernel only accepts that flag at registration time.
+ */
+int update_event(int fd, unsigned int set, unsigned int clear)
 {
-	event_loop_refresh = true;
+	int ret;
+	struct event_info *ei;
+	unsigned int flags;
+
+	bs_mutex_lock(&events_lock);
+	ei = lookup_event(fd);
+	if (!ei) {
+		bs_mutex_unlock(&events_lock);
+		bs_debug("event info for fd %d not found", fd);
+		return -1;
+	}
+
+	flags = (ei->flags | set) & ~clear;
+	if ((ei->flags | flags) & EVENT_EXCLUSIVE) {
+		bs_mutex_unlock(&events_lock);
+		errno = EINVAL;
+		return -1;
+	}
+
+	uatomic_set(&ei->events, event_flags_to_epoll(flags));
+	ret = ei->r->ops->mod(ei->r, ei);
+	if (!ret)
+		uatomic_set(&ei->flags, flags);
+	bs_mutex_unlock(&events_lock);
+	if (ret) {
+		bs_debug("failed to modify epoll event for fd %d: %m", fd);
+		return -1;
+	}
+	return 0;
 }
 
-void event_loop(int timeout)
+/*
+ * Arm an EVENT_ONESHOT registration again after its handler has run.  The
+ * kernel disables the fd after every notification until this is called.
+ */
+int rearm_event(int fd)
 {
-	int i, nr;
+	int ret;
+	struct event_info *ei;
 
-refresh:
-	event_loop_refresh = false;
-	nr = epoll_wait(efd, events, nr_events, timeout);
-	if (nr < 0) {
-		if (errno == EINTR)
-			return;
-		fprintf(stderr, "epoll_wait failed: %m");
-		exit(1);
-	} else if (nr) {
-		for (i = 0; i < nr; i++) {
-			struct event_info *ei;
+	event_read_lock();
+	ei = lookup_event(fd);
+	if (!ei) {
+		event_read_unlock();
+		bs_debug("event info for fd %d not found", fd);
+		return -1;
+	}
 
-			ei = (struct event_info *)events[i].data.ptr;
-			ei->handler(ei->fd, events[i].events, ei->data);
+	uatomic_set(&ei->events, event_flags_to_epoll(uatomic_read(&ei->flags)));
+	ret = ei->r->ops->rearm(ei->r, ei);
+	event_read_unlock();
+	if (ret) {
+		bs_debug("failed to rearm epoll event for fd %d: %m", fd);
+		return -1;
+	}
+	return 0;
+}
 
-			if (event_loop_refresh)
-				goto refresh;
-		}
+static void event_vec_add(struct epoll_event **ev, int *nr, int *size,
+			  uint64_t tag, unsigned int events)
+{
+	if (*nr == *size) {
+		*size = *size ? *size * 2 : 16;
+		*ev = xrealloc(*ev, *size * sizeof(**ev));
 	}
+	(*ev)[*nr].events = events;
+	(*ev)[*nr].data.u64 = tag;
+	(*nr)++;
+}
+
+static void reactor_add_ready(struct reactor *r, uint64_t tag,
+			      unsigned int events)
+{
+	event_vec_add(&r->ready, &r->nr_ready, &r->ready_size, tag, events);
+}
 
+/*
+ * Handlers of EVENT_ET registrations must read or write until EAGAIN,
+ * otherwise the kernel never reports the fd again.  A handler which stops
+ * early to be fair to other fds calls this to be dispatched again with the
+ * same events in the next iteration of its reactor.  Must be called from
+ * the handler, i.e. the reactor thread.
+ */
+void event_requeue(int fd, int events)
+{
+	struct event_info *ei;
+
+	event_read_lock();
+	ei = lookup_event(fd);
+	if (ei && !ei->accept)
+		reactor_add_ready(this_reactor(), event_tag(ei), events);
+	event_read_unlock();
+}
+
+/* Returns the registration tag refers to if it is still alive */
+static struct event_info *reactor_lookup(struct reactor *r, uint64_t tag)
+{
+	struct event_info *ei;
+
+	ei = lookup_event(event_tag_fd(tag));
+	if (unlikely(!ei || ei->gen != event_tag_gen(tag) || ei->r != r))
+		return NULL;
+
+	return ei;
+}
+
+static uint64_t get_nsec_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * res is an epoll format event mask, except for listeners of a backend which
+ * accepts by itself, where it is the accepted fd.
+ */
+static void event_call(struct reactor *r, struct event_info *ei, int res)
+{
+	if (unlikely(ei->accept)) {
+		if (!r->ops->accepts) {
+			res = accept4(ei->fd, NULL, NULL, SOCK_CLOEXEC);
+			if (res < 0) {
+				if (errno != EAGAIN && errno != EINTR)
+					bs_err("failed to accept: %m");
+				return;
+			}
+		}
+		ei->accept(ei->fd, res, ei->data);
+		return;
+	}
+
+	ei->handler(ei->fd, res, ei->data);
+}
+
+static noinline void event_call_timed(struct reactor *r,
+				      struct event_info *ei, int res)
+{
+	struct event_stats *stats = ei->stats;
+	uint64_t start;
+
+	if (!stats) {
+		stats = xcalloc(1, sizeof(*stats));
+		smp_store_release(&ei->stats, stats);
+	}
+
+	start = get_nsec_time();
+	event_call(r, ei, res);
+	/* ei stays valid in this epoch even if the handler unregistered it */
+	hist_record(&stats->runtime, get_nsec_time() - start);
+}
+
+static inline void event_run(struct reactor *r, struct event_info *ei,
+			     int res)
+{
+	if (likely(!uatomic_read(&event_stats_enabled)))
+		event_call(r, ei, res);
+	else
+		event_call_timed(r, ei, res);
+}
+
+/* Must be called inside event_read_lock() */
+static void reactor_dispatch(struct reactor *r, uint64_t tag, int res)
+{
+	struct event_vec *v;
+	struct event_info *ei;
+
+	ei = reactor_lookup(r, tag);
+	if (!ei)
+		return;
+
+	if (unlikely(r->sorting)) {
+		v = &r->sorted[ei->prio];
+		event_vec_add(&v->ev, &v->nr, &v->size, tag, res);
+		return;
+	}
+
+	event_run(r, ei, res);
+}
+
+/*
+ * Whether an event which didn't fit into the budget has to be kept.  Level
+ * triggered fds are reported again as long as they stay ready, by epoll or
+ * by the re-armed io_uring poll.
+ */
+static bool event_must_keep(struct reactor *r, struct event_info *ei)
+{
+	if (ei->accept)
+		return r->ops->accepts;
+	return ei->flags & (EVENT_ET | EVENT_ONESHOT);
+}
+
+/*
+ * Dispatch the events sorted by reactor_dispatch(), highest class first.
+ * What exceeds the budget is left to the next iteration.  Must be called
+ * inside event_read_lock().
+ */
+static void reactor_dispatch_sorted(struct reactor *r)
+{
+	unsigned int budget = r->budget ? r->budget : UINT_MAX;
+	struct event_info *ei;
+	struct event_vec *v;
+	int prio, i;
+
+	for (prio = 0; prio < EVENT_NR_PRIO; prio++) {
+		v = &r->sorted[prio];
+		for (i = 0; i < v->nr; i++) {
+			/* earlier handlers may have unregistered it */
+			ei = reactor_lookup(r, v->ev[i].data.u64);
+			if (!ei)
+				continue;
+
+			if (budget == 0) {
+				if (event_must_keep(r, ei))
+					reactor_add_ready(r, v->ev[i].data.u64,
+							  v->ev[i].events);
+				continue;
+			}
+			budget--;
+			event_run(r, ei, v->ev[i].events);
+		}
+		v->nr = 0;
+	}
+}
+
+static int epoll_init(struct reactor *r, int nr)
+{
+	r->nr_events = r->min_events = nr;
+	r->max_events = max(nr, EVENT_BATCH_MAX);
+	r->events = xcalloc(nr, sizeof(struct epoll_event));
+
+	r->efd = epoll_create(nr);
+	if (r->efd < 0) {
+		free(r->events);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void epoll_exit(struct reactor *r)
+{
+	close(r->efd);
+	free(r->events);
+}
+
+static int epoll_ctl_event(struct reactor *r, int op, struct event_info *ei)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = uatomic_read(&ei->events);
+	ev.data.u64 = event_tag(ei);
+
+	return epoll_ctl(r->efd, op, ei->fd, &ev);
+}
+
+static int epoll_add(struct reactor *r, struct event_info *ei)
+{
+	return epoll_ctl_event(r, EPOLL_CTL_ADD, ei);
+}
+
+static int epoll_mod(struct reactor *r, struct event_info *ei)
+{
+	return epoll_ctl_event(r, EPOLL_CTL_MOD, ei);
+}
+
+static int epoll_del(struct reactor *r, struct event_info *ei)
+{
+	return epoll_ctl(r->efd, EPOLL_CTL_DEL, ei->fd, NULL);
+}
+
+static int epoll_wait_events(struct reactor *r, int timeout)
+{
+	return epoll_wait(r->efd, r->events, r->nr_events, timeout);
+}
+
+static int epoll_busy_poll(struct reactor *r, unsigned int usec,
+			   unsigned int budget)
+{
+	struct epoll_params params;
+
+	memset(&params, 0, sizeof(params));
+	params.busy_poll_usecs = usec;
+	params.busy_poll_budget = budget;
+	params.prefer_busy_poll = usec ? 1 : 0;
+
+	return ioctl(r->efd, EPIOCSPARAMS, &params);
+}
+
+/*
+ * Double the event array when a wait fills it, halve it after
+ * EVENT_BATCH_SHRINK waits in a row used less than a quarter of it.
+ */
+static void epoll_tune_batch(struct reactor *r, int nr)
+{
+	int size = r->nr_events;
+
+	if (nr == size && size < r->max_events) {
+		size = min(size * 2, r->max_events);
+	} else if (nr < size / 4 && size > r->min_events) {
+		if (++r->nr_sparse_waits < EVENT_BATCH_SHRINK)
+			return;
+		size = max(size / 2, r->min_events);
+	} else {
+		r->nr_sparse_waits = 0;
+		return;
+	}
+
+	r->nr_sparse_waits = 0;
+	r->events = xrealloc(r->events, size * sizeof(struct epoll_event));
+	r->nr_events = size;
+}
+
+static void epoll_dispatch(struct reactor *r, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		reactor_dispatch(r, r->events[i].data.u64,
+				 r->events[i].events);
+
+	epoll_tune_batch(r, nr);
+}
+
+static const struct event_backend_ops epoll_ops = {
+	.name = "epoll",
+	.init = epoll_init,
+	.exit = epoll_exit,
+	.add = epoll_add,
+	.mod = epoll_mod,
+	.rearm = epoll_mod,
+	.del = epoll_del,
+	.wait = epoll_wait_events,
+	.dispatch = epoll_dispatch,
+	.busy_poll = epoll_busy_poll,
+};
+
+/*
+ * io_uring backend
+ *
+ * Each registration is a poll request, or a multishot accept for listeners,
+ * whose user_data is the registration tag.  io_uring polls are edge
+ * triggered, so only EVENT_ET registrations use multishot polls.  Level
+ * triggered and exclusive ones use single shot polls which are re-armed
+ * after the handler has run and complete at once while the fd stays ready.
+ *
+ * Requests are only queued on the reactor thread and submitted together with
+ * the wait for completions, so a state change costs no system call; other
+ * threads submit right away since the reactor may be sleeping.  Changing the
+ * mask updates the pending poll in place.
+ */
+static int uring_backend_init(struct reactor *r, int nr)
+{
+	/* the CQ ring can't be resized like the epoll batch, start big */
+	r->nr_events = max(nr, EVENT_BATCH_MAX) * 4;
+	if (uring_init(&r->ring, nr, r->nr_events) < 0)
+		return -1;
+
+	bs_init_mutex(&r->sq_lock);
+	return 0;
+}
+
+static void uring_backend_exit(struct reactor *r)
+{
+	uring_exit(&r->ring);
+	bs_destroy_mutex(&r->sq_lock);
+	free(r->rearm.ev);
+}
+
+static void uring_queue(struct reactor *r, const struct io_uring_sqe *sqe)
+{
+	bs_mutex_lock(&r->sq_lock);
+	uring_push(&r->ring, sqe);
+	bs_mutex_unlock(&r->sq_lock);
+
+	if (current_reactor != r)
+		uring_submit(&r->ring);
+}
+
+static bool uring_multishot(unsigned int events)
+{
+	return (events & EPOLLET) && !(events & (EPOLLONESHOT | EPOLLEXCLUSIVE));
+}
+
+static void uring_arm(struct reactor *r, struct event_info *ei)
+{
+	unsigned int events = uatomic_read(&ei->events);
+	struct io_uring_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.fd = ei->fd;
+	sqe.user_data = event_tag(ei);
+
+	if (ei->accept) {
+		sqe.opcode = IORING_OP_ACCEPT;
+		sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe.accept_flags = SOCK_CLOEXEC;
+	} else {
+		sqe.opcode = IORING_OP_POLL_ADD;
+		sqe.poll32_events = events & ~(EPOLLET | EPOLLONESHOT);
+		if (uring_multishot(events))
+			sqe.len = IORING_POLL_ADD_MULTI;
+	}
+
+	uring_queue(r, &sqe);
+}
+
+/*
+ * Fails with -ENOENT if a single shot poll has already completed; it is then
+ * re-armed with the new mask after its handler has run.
+ */
+static void uring_update(struct reactor *r, struct event_info *ei)
+{
+	unsigned int events = uatomic_read(&ei->events);
+	struct io_uring_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_POLL_REMOVE;
+	sqe.fd = -1;
+	sqe.addr = event_tag(ei);
+	sqe.len = IORING_POLL_UPDATE_EVENTS;
+	if (uring_multishot(events))
+		sqe.len |= IORING_POLL_ADD_MULTI;
+	sqe.poll32_events = events & ~(EPOLLET | EPOLLONESHOT);
+
+	uring_queue(r, &sqe);
+}
+
+static void uring_cancel(struct reactor *r, struct event_info *ei)
+{
+	struct io_uring_sqe sqe;
+
+	memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = IORING_OP_ASYNC_CANCEL;
+	sqe.fd = -1;
+	sqe.addr = event_tag(ei);
+
+	uring_queue(r, &sqe);
+}
+
+static int uring_add(struct reactor *r, struct event_info *ei)
+{
+	uring_arm(r, ei);
+	return 0;
+}
+
+static int uring_mod(struct reactor *r, struct event_info *ei)
+{
+	if (ei->accept) {
+		uring_cancel(r, ei);
+		uring_arm(r, ei);
+	} else
+		uring_update(r, ei);
+	return 0;
+}
+
+/* A oneshot poll is gone once it has completed */
+static int uring_rearm(struct reactor *r, struct event_info *ei)
+{
+	uring_arm(r, ei);
+	return 0;
+}
+
+static int uring_del(struct reactor *r, struct event_info *ei)
+{
+	uring_cancel(r, ei);
+	return 0;
+}
+
+static unsigned int uring_cq_ready(struct uring *u)
+{
+	return smp_load_acquire(u->cq_tail) - *u->cq_head;
+}
+
+/* Returns the number of completions ready to be dispatched */
+static int uring_wait_events(struct reactor *r, int timeout)
+{
+	int ret;
+
+	/* spinning reactors peek at the ring without a system call */
+	if (timeout == 0 && !uring_sq_pending(&r->ring))
+		return uring_cq_ready(&r->ring);
+
+	ret = uring_wait(&r->ring, timeout);
+	if (ret < 0)
+		return ret;
+
+	return uring_cq_ready(&r->ring);
+}
+
+/* Backoff before accepting again after a multishot accept failed */
+#define URING_ACCEPT_RETRY_MS	10
+
+struct uring_retry {
+	struct event_timer timer;
+	struct reactor *r;
+	uint64_t tag;
+};
+
+static void uring_retry_accept(void *data)
+{
+	struct uring_retry *retry = data;
+	struct event_info *ei;
+
+	/*
+	 * The listener may have been unregistered meanwhile.  Timers run
+	 * outside the epoch of the dispatch, so enter one to keep ei alive.
+	 */
+	event_read_lock();
+	ei = reactor_lookup(retry->r, retry->tag);
+	if (ei)
+		uring_arm(retry->r, ei);
+	event_read_unlock();
+	free(retry);
+}
+
+static void uring_complete(struct reactor *r, struct io_uring_cqe *cqe)
+{
+	bool more = cqe->flags & IORING_CQE_F_MORE;
+	struct uring_retry *retry;
+	struct event_info *ei;
+
+	/* a cancelled request has already been replaced or unregistered */
+	if (cqe->res == -ECANCELED)
+		return;
+
+	if (cqe->res >= 0)
+		reactor_dispatch(r, cqe->user_data, cqe->res);
+	else if (!more) {
+		bs_err("request for fd %d failed: %s",
+		       event_tag_fd(cqe->user_data), strerror(-cqe->res));
+
+		/*
+		 * A listener keeps accepting on epoll whatever accept4()
+		 * returned, e.g. EMFILE, so retry here too, after a backoff
+		 * leaving time to close some fds.
+		 */
+		ei = reactor_lookup(r, cqe->user_data);
+		if (ei && ei->accept) {
+			retry = xcalloc(1, sizeof(*retry));
+			retry->r = r;
+			retry->tag = cqe->user_data;
+			init_event_timer(&retry->timer, uring_retry_accept,
+					 retry);
+			add_event_timer(&retry->timer, URING_ACCEPT_RETRY_MS);
+		}
+	}
+
+	/*
+	 * Single shot polls and multishot requests the kernel has ended, e.g.
+	 * on completion queue overflow, are armed again after the handlers,
+	 * which might run only after the whole batch has been sorted by
+	 * priority.  A poll armed before its handler drained the fd would
+	 * complete again at once.
+	 */
+	if (more || cqe->res < 0)
+		return;
+	event_vec_add(&r->rearm.ev, &r->rearm.nr, &r->rearm.size,
+		      cqe->user_data, 0);
+}
+
+/* Re-arm what is still registered, except oneshot registrations */
+static void uring_flush(struct reactor *r)
+{
+	struct event_info *ei;
+	int i;
+
+	for (i = 0; i < r->rearm.nr; i++) {
+		ei = reactor_lookup(r, r->rearm.ev[i].data.u64);
+		if (ei && !(uatomic_read(&ei->events) & EPOLLONESHOT))
+			uring_arm(r, ei);
+	}
+	r->rearm.nr = 0;
+}
+
+static void uring_dispatch(struct reactor *r, int nr)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+
+	uring_for_each_cqe(&r->ring, head, cqe) {
+		if (cqe->user_data)
+			uring_complete(r, cqe);
+	}
+	uring_cq_advance(&r->ring, head);
+}
+
+static const struct event_backend_ops uring_ops = {
+	.name = "io_uring",
+	.init = uring_backend_init,
+	.exit = uring_backend_exit,
+	.add = uring_add,
+	.mod = uring_mod,
+	.rearm = uring_rearm,
+	.del = uring_del,
+	.wait = uring_wait_events,
+	.dispatch = uring_dispatch,
+	.flush = uring_flush,
+	.accepts = true,
+};
+
+static uint64_t get_usec_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Reactor timers
+ *
+ * Every reactor keeps its armed timers in a binary min-heap, bounds the wait
+ * for events by the nearest expiry and runs the expired callbacks after the
+ * I/O handlers.  Timers are embedded in their user and only ever touched by
+ * the thread of the reactor they were added on, so they need neither a
+ * kernel object nor a lock.
+ */
+static void timer_heap_set(struct reactor *r, int i, struct event_timer *t)
+{
+	r->timers[i] = t;
+	t->idx = i;
+}
+
+static void timer_heap_up(struct reactor *r, int i)
+{
+	struct event_timer *t = r->timers[i];
+	int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (r->timers[parent]->expire <= t->expire)
+			break;
+		timer_heap_set(r, i, r->timers[parent]);
+		i = parent;
+	}
+	timer_heap_set(r, i, t);
+}
+
+static void timer_heap_down(struct reactor *r, int i)
+{
+	struct event_timer *t = r->timers[i];
+	int child;
+
+	while ((child = 2 * i + 1) < r->nr_timers) {
+		if (child + 1 < r->nr_timers &&
+		    r->timers[child + 1]->expire < r->timers[child]->expire)
+			child++;
+		if (t->expire <= r->timers[child]->expire)
+			break;
+		timer_heap_set(r, i, r->timers[child]);
+		i = child;
+	}
+	timer_heap_set(r, i, t);
+}
+
+static void timer_heap_remove(struct reactor *r, struct event_timer *t)
+{
+	struct event_timer *last = r->timers[--r->nr_timers];
+	int i = t->idx;
+
+	t->idx = -1;
+	if (last == t)
+		return;
+
+	timer_heap_set(r, i, last);
+	timer_heap_up(r, i);
+	timer_heap_down(r, last->idx);
+}
+
+void init_event_timer(struct event_timer *t, void (*fn)(void *), void *data)
+{
+	t->fn = fn;
+	t->data = data;
+	t->idx = -1;
+	t->r = NULL;
+}
+
+/*
+ * Arm t to fire msec milliseconds from now on the reactor of the calling
+ * thread, or move its expiry if it is already armed.  The callback runs once;
+ * it may add the timer again.
+ */
+void add_event_timer(struct event_timer *t, unsigned int msec)
+{
+	struct reactor *r = this_reactor();
+
+	if (event_timer_pending(t)) {
+		assert(t->r == r);
+		t->expire = get_usec_time() + (uint64_t)msec * 1000;
+		timer_heap_up(r, t->idx);
+		timer_heap_down(r, t->idx);
+		return;
+	}
+
+	if (r->nr_timers == r->timers_size) {
+		r->timers_size = r->timers_size ? r->timers_size * 2 : 64;
+		r->timers = xrealloc(r->timers,
+				     r->timers_size * sizeof(*r->timers));
+	}
+
+	t->r = r;
+	t->expire = get_usec_time() + (uint64_t)msec * 1000;
+	timer_heap_set(r, r->nr_timers++, t);
+	timer_heap_up(r, t->idx);
+}
+
+/* Disarm t if it is pending.  Must be called by the thread which added it. */
+void del_event_timer(struct event_timer *t)
+{
+	if (!event_timer_pending(t))
+		return;
+
+	assert(t->r == this_reactor());
+	timer_heap_remove(t->r, t);
+}
+
+/*
+ * Run fn(arg) on the thread of r, after the handlers of its current or next
+ * iteration.  Safe to call from any thread.  Fails with EAGAIN when r has
+ * EVENT_POST_RING_SIZE tasks pending, EINVAL if r isn't set up yet, i.e.
+ * the main reactor before init_event().
+ *
+ * Producers only write the eventfd of r when they find it about to block,
+ * so a burst of posts costs a single wakeup.
+ */
+int event_post(struct reactor *r, void (*fn)(void *), void *arg)
+{
+	struct event_post_ring *ring = r->post;
+	struct event_post_slot *slot;
+	uint64_t pos, seq;
+
+	if (unlikely(!ring)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pos = uatomic_read(&ring->tail);
+	for (;;) {
+		slot = &ring->slots[pos % EVENT_POST_RING_SIZE];
+		seq = smp_load_acquire(&slot->seq);
+		if (seq == pos) {
+			if (uatomic_cmpxchg(&ring->tail, pos, pos + 1) == pos)
+				break;
+		} else if (seq < pos) {
+			errno = EAGAIN;
+			return -1;
+		}
+		pos = uatomic_read(&ring->tail);
+	}
+
+	slot->fn = fn;
+	slot->arg = arg;
+	smp_store_release(&slot->seq, pos + 1);
+
+	/* pairs with the barrier in post_prepare_wait() */
+	smp_mb();
+	if (uatomic_read(&ring->idle) && uatomic_xchg(&ring->idle, false))
+		eventfd_xwrite(r->post_efd, 1);
+
+	return 0;
+}
+
+static bool post_pending(struct event_post_ring *ring)
+{
+	struct event_post_slot *slot;
+
+	slot = &ring->slots[ring->head % EVENT_POST_RING_SIZE];
+	return smp_load_acquire(&slot->seq) == ring->head + 1;
+}
+
+/*
+ * Called before a blocking wait.  Returns true if tasks are pending and the
+ * wait must not block, otherwise producers will wake us up from now on.
+ */
+static bool post_prepare_wait(struct reactor *r)
+{
+	struct event_post_ring *ring = r->post;
+
+	uatomic_set(&ring->idle, true);
+	smp_mb();
+	if (post_pending(ring)) {
+		uatomic_set(&ring->idle, false);
+		return true;
+	}
+
+	return false;
+}
+
+/* Run up to EVENT_POST_BATCH posted tasks */
+static void reactor_run_posted(struct reactor *r)
+{
+	struct event_post_ring *ring = r->post;
+	struct event_post_slot *slot;
+	void (*fn)(void *);
+	void *arg;
+	int i;
+
+	uatomic_set(&ring->idle, false);
+	for (i = 0; i < EVENT_POST_BATCH; i++) {
+		slot = &ring->slots[ring->head % EVENT_POST_RING_SIZE];
+		if (smp_load_acquire(&slot->seq) != ring->head + 1)
+			break;
+
+		fn = slot->fn;
+		arg = slot->arg;
+		/* hand the slot over to the producers of the next lap */
+		smp_store_release(&slot->seq, ring->head + EVENT_POST_RING_SIZE);
+		ring->head++;
+
+		fn(arg);
+	}
+}
+
+/* Clamp a wait timeout in ms so that it ends by the nearest expiry */
+static int reactor_timeout(struct reactor *r, int timeout)
+{
+	uint64_t now, expire, msec;
+
+	if (!r->nr_timers)
+		return timeout;
+
+	now = get_usec_time();
+	expire = r->timers[0]->expire;
+	if (expire <= now)
+		return 0;
+
+	/* round up, waking before the expiry would only spin */
+	msec = (expire - now + 999) / 1000;
+	if (timeout < 0 || msec < (uint64_t)timeout)
+		return msec;
+	return timeout;
+}
+
+static void reactor_run_timers(struct reactor *r)
+{
+	struct event_timer *t;
+	uint64_t now;
+
+	if (!r->nr_timers)
+		return;
+
+	now = get_usec_time();
+	while (r->nr_timers && r->timers[0]->expire <= now) {
+		t = r->timers[0];
+		timer_heap_remove(r, t);
+		t->fn(t->data);
+	}
+}
+
+/*
+ * Poll without blocking for up to spin_usec, then block for the rest of
+ * timeout.  Returns what the backend's wait returns.
+ */
+static int reactor_wait(struct reactor *r, int timeout)
+{
+	uint64_t start, elapsed;
+	unsigned int spin_usec = uatomic_read(&r->spin_usec);
+	int nr;
+
+	if (timeout == 0 || spin_usec == 0)
+		goto block;
+
+	start = get_usec_time();
+	do {
+		nr = r->ops->wait(r, 0);
+		if (nr != 0) {
+			if (nr > 0)
+				r->spin_wakeups++;
+			return nr;
+		}
+		elapsed = get_usec_time() - start;
+	} while (elapsed < spin_usec);
+
+	if (timeout > 0) {
+		timeout -= elapsed / 1000;
+		if (timeout <= 0)
+			return 0;
+	}
+block:
+	nr = r->ops->wait(r, timeout);
+	if (nr > 0 && timeout != 0)
+		r->block_wakeups++;
+
+	return nr;
+}
+
+void reactor_loop(struct reactor *r, int timeout)
+{
+	struct epoll_event *ready;
+	int i, nr, nr_ready, ready_size;
+
+	current_reactor = r;
+
+	/*
+	 * Requeued fds are dispatched right after polling without blocking.
+	 * Handlers may requeue again meanwhile, so they get the spare buffer.
+	 */
+	ready = r->ready;
+	nr_ready = r->nr_ready;
+	ready_size = r->ready_size;
+	r->ready = r->ready_spare;
+	r->ready_size = r->spare_size;
+	r->nr_ready = 0;
+
+	timeout = nr_ready ? 0 : reactor_timeout(r, timeout);
+	if (timeout != 0 && post_prepare_wait(r))
+		timeout = 0;
+	nr = reactor_wait(r, timeout);
+	if (nr < 0) {
+		if (errno != EINTR) {
+			fprintf(stderr, "%s wait failed: %m", r->ops->name);
+			exit(1);
+		}
+		nr = 0;
+	}
+
+	if (unlikely(uatomic_read(&event_stats_enabled)) && nr > 0)
+		hist_record(&r->batch_hist, nr);
+
+	r->sorting = uatomic_read(&r->nr_prio_regs) || uatomic_read(&r->budget);
+
+	event_read_lock();
+	r->ops->dispatch(r, nr);
+	for (i = 0; i < nr_ready; i++)
+		reactor_dispatch(r, ready[i].data.u64, ready[i].events);
+	if (r->sorting)
+		reactor_dispatch_sorted(r);
+	if (r->ops->flush)
+		r->ops->flush(r);
+	event_read_unlock();
+
+	r->ready_spare = ready;
+	r->spare_size = ready_size;
+
+	reactor_run_timers(r);
+	reactor_run_posted(r);
+
+	/* free what unregistered handlers left behind without blocking */
+	if (uatomic_read(&nr_limbo) && !bs_mutex_trylock(&events_lock)) {
+		event_reclaim();
+		bs_mutex_unlock(&events_lock);
+	}
+}
+
+void event_loop(int timeout)
+{
+	reactor_loop(&main_reactor, timeout);
+}
+
+/*
+ * Make r spin for up to usec microseconds on non-blocking polls before it
+ * blocks.  0 disables spinning.
+ */
+void set_reactor_spin(struct reactor *r, unsigned int usec)
+{
+	uatomic_set(&r->spin_usec, usec);
+}
+
+/*
+ * Enable kernel busy polling for r: the epoll busy poll parameters of its
+ * instance where the backend supports them, and SO_BUSY_POLL on the sockets
+ * registered from now on.  0 disables it.
+ */
+int set_reactor_busy_poll(struct reactor *r, unsigned int usec,
+			  unsigned int budget)
+{
+	int ret = 0;
+
+	bs_mutex_lock(&events_lock);
+	r->busy_poll_usec = usec;
+	bs_mutex_unlock(&events_lock);
+
+	if (r->ops->busy_poll) {
+		ret = r->ops->busy_poll(r, usec, budget);
+		if (ret)
+			bs_warn("failed to set %s busy poll: %m", r->ops->name);
+	}
+
+	return ret;
+}
+
+/*
+ * Dispatch at most budget events per iteration of r, higher priority classes
+ * first; the rest waits for the next iteration, which doesn't block.  0
+ * means no limit.
+ */
+void set_reactor_budget(struct reactor *r, unsigned int budget)
+{
+	uatomic_set(&r->budget, budget);
+}
+
+void get_reactor_stats(struct reactor *r, struct reactor_stats *stats)
+{
+	stats->spin_wakeups = uatomic_read(&r->spin_wakeups);
+	stats->block_wakeups = uatomic_read(&r->block_wakeups);
+	stats->batch_size = uatomic_read(&r->nr_events);
+	stats->batch = r->batch_hist;
+}
+
+/*
+ * Per handler instrumentation
+ *
+ * While disabled, the dispatcher only pays for testing a flag.  Statistics
+ * collected so far are kept when it is disabled again.
+ */
+void enable_event_stats(bool enable)
+{
+	uatomic_set(&event_stats_enabled, enable);
+}
+
+/*
+ * Take a snapshot of the statistics of every registration which has been
+ * dispatched while enabled.  Returns the number of entries stored in *snap,
+ * which the caller frees.
+ */
+int get_event_stats(struct event_handler_stats **snap)
+{
+	struct event_handler_stats *st = NULL;
+	struct event_table *t;
+	struct event_info *ei;
+	struct event_stats *stats;
+	int fd, nr = 0, size = 0;
+
+	event_read_lock();
+	t = smp_load_acquire(&events_table);
+	for (fd = 0; fd < t->nr; fd++) {
+		ei = smp_load_acquire(&t->slots[fd]);
+		if (!ei)
+			continue;
+		stats = smp_load_acquire(&ei->stats);
+		if (!stats)
+			continue;
+
+		if (nr == size) {
+			size = size ? size * 2 : 64;
+			st = xrealloc(st, size * sizeof(*st));
+		}
+		st[nr].fd = fd;
+		st[nr].reactor = ei->r->idx;
+		st[nr].handler = ei->accept ? (void *)ei->accept :
+			(void *)ei->handler;
+		st[nr].data = ei->data;
+		st[nr].runtime = stats->runtime;
+		nr++;
+	}
+	event_read_unlock();
+
+	*snap = st;
+	return nr;
+}
+
+static void __dump_event_stats(FILE *fp)
+{
+	struct event_handler_stats *st;
+	struct reactor_stats rs;
+	char name[64];
+	int i, nr;
+
+	for (i = 0; i < get_nr_reactors(); i++) {
+		get_reactor_stats(reactors[i], &rs);
+		fprintf(fp, "reactor %d spin_wakeups %" PRIu64
+			" block_wakeups %" PRIu64 " batch_size %d\n", i,
+			rs.spin_wakeups, rs.block_wakeups, rs.batch_size);
+		hist_dump(fp, "  events/wait", &rs.batch);
+	}
+
+	nr = get_event_stats(&st);
+	for (i = 0; i < nr; i++) {
+		snprintf(name, sizeof(name), "fd %d reactor %d handler %p ns",
+			 st[i].fd, st[i].reactor, st[i].handler);
+		hist_dump(fp, name, &st[i].runtime);
+	}
+	free(st);
+}
+
+/* Write the statistics of all reactors and handlers as text to fd */
+int dump_event_stats(int fd)
+{
+	FILE *fp;
+
+	fp = fdopen(dup(fd), "w");
+	if (!fp)
+		return -1;
+
+	__dump_event_stats(fp);
+	return fclose(fp);
+}
+
+/*
+ * A dump on its way to a stats connection.  The connection is non-blocking
+ * and the rest of the dump is written on EVENT_OUT, so that a client which
+ * doesn't read can't stall the reactor.
+ */
+struct stats_conn {
+	char *buf;
+	size_t len;
+	size_t off;
+};
+
+/* Returns false while the socket is full, true once done or failed */
+static bool stats_write(int fd, struct stats_conn *c)
+{
+	ssize_t ret;
+
+	while (c->off < c->len) {
+		ret = send(fd, c->buf + c->off, c->len - c->off, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno != EAGAIN;
+		}
+		c->off += ret;
+	}
+
+	return true;
+}
+
+static void stats_conn_free(int fd, struct stats_conn *c)
+{
+	close(fd);
+	free(c->buf);
+	free(c);
+}
+
+static void stats_handler(int fd, int events, void *data)
+{
+	struct stats_conn *c = data;
+
+	if (!stats_write(fd, c))
+		return;
+
+	unregister_event(fd);
+	stats_conn_free(fd, c);
+}
+
+static void stats_accept(int listen_fd, int fd, void *data)
+{
+	struct stats_conn *c = xcalloc(1, sizeof(*c));
+	FILE *fp;
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		goto out;
+
+	fp = open_memstream(&c->buf, &c->len);
+	if (!fp)
+		goto out;
+	__dump_event_stats(fp);
+	if (fclose(fp))
+		goto out;
+
+	if (stats_write(fd, c))
+		goto out;
+	if (register_event_ex(fd, stats_handler, c, EVENT_OUT) < 0) {
+		bs_err("failed to register stats connection: %m");
+		goto out;
+	}
+	return;
+out:
+	stats_conn_free(fd, c);
+}
+
+static int stats_listen(int fd, void *data)
+{
+	return register_accept_event(fd, stats_accept, NULL);
+}
+
+/*
+ * Serve dump_event_stats() on a unix domain socket at path; every
+ * connection receives one dump, e.g. "socat - UNIX-CONNECT:path".
+ */
+int serve_event_stats(const char *path)
+{
+	unlink(path);
+	return create_unix_domain_socket(path, stats_listen, NULL);
 }
@@ -1,15 +1,109 @@
 #ifndef __EVENT_H__
 #define __EVENT_H__
 
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "histogram.h"
+
 struct event_info;
+struct reactor;
 
 typedef void (*event_handler_t)(int fd, int events, void *data);
+typedef void (*accept_handler_t)(int listen_fd, int fd, void *data);
+
+struct reactor_stats {
+	uint64_t spin_wakeups;	/* events found while spinning */
+	uint64_t block_wakeups;	/* events found after blocking */
+	struct histogram batch;	/* events per wait */
+	int batch_size;		/* max events per wait */
+};
+
+struct event_handler_stats {
+	int fd;
+	int reactor;
+	void *handler;
+	void *data;
+	struct histogram runtime;	/* ns per dispatch */
+};
+
+/*
+ * A timer run by a reactor, see add_event_timer().  Embed it in the object it
+ * times out and set it up with init_event_timer().
+ */
+struct event_timer {
+	/* private */
+	uint64_t expire;	/* CLOCK_MONOTONIC, in usec */
+	int idx;		/* slot in the reactor's heap, -1 if disarmed */
+	struct reactor *r;
+
+	/* public */
+	void (*fn)(void *data);
+	void *data;
+};
+
+enum event_backend {
+	EVENT_BACKEND_EPOLL,
+	EVENT_BACKEND_URING,
+};
+
+/*
+ * Registration flags
+ *
+ * EVENT_ET: edge triggered, the handler must drain the fd until EAGAIN or
+ *           call event_requeue()
+ * EVENT_ONESHOT: the fd is disabled after each notification until
+ *                rearm_event() is called
+ * EVENT_EXCLUSIVE: wake up only one of the reactors sharing a listener; each
+ *                  reactor registers its own dup() of the listening fd
+ * EVENT_PRIO_HIGH, EVENT_PRIO_LOW: priority class, see set_reactor_budget();
+ *                  normal without either
+ */
+#define EVENT_IN		(1U << 0)
+#define EVENT_OUT		(1U << 1)
+#define EVENT_ET		(1U << 2)
+#define EVENT_ONESHOT		(1U << 3)
+#define EVENT_EXCLUSIVE		(1U << 4)
+#define EVENT_PRIO_HIGH		(1U << 5)
+#define EVENT_PRIO_LOW		(1U << 6)
 
 int init_event(int nr);
+int init_event_backend(int nr, enum event_backend backend);
+const char *event_backend_name(void);
+struct reactor *create_reactor(int cpu, int nr);
+int get_nr_reactors(void);
+struct reactor *get_reactor(int idx);
+struct reactor *pick_reactor(unsigned int hint);
 int register_event(int fd, event_handler_t h, void *data);
+int register_event_ex(int fd, event_handler_t h, void *data,
+		      unsigned int flags);
+int register_event_on(struct reactor *r, int fd, event_handler_t h,
+		      void *data, unsigned int flags);
+int register_accept_event(int fd, accept_handler_t h, void *data);
 void unregister_event(int fd);
 int modify_event(int fd, unsigned int events);
+int update_event(int fd, unsigned int set, unsigned int clear);
+int rearm_event(int fd);
+void event_requeue(int fd, int events);
+void init_event_timer(struct event_timer *t, void (*fn)(void *), void *data);
+void add_event_timer(struct event_timer *t, unsigned int msec);
+void del_event_timer(struct event_timer *t);
+int event_post(struct reactor *r, void (*fn)(void *), void *arg);
+void reactor_loop(struct reactor *r, int timeout);
 void event_loop(int timeout);
-void event_force_refresh(void);
+void set_reactor_spin(struct reactor *r, unsigned int usec);
+int set_reactor_busy_poll(struct reactor *r, unsigned int usec,
+			  unsigned int budget);
+void set_reactor_budget(struct reactor *r, unsigned int budget);
+void get_reactor_stats(struct reactor *r, struct reactor_stats *stats);
+void enable_event_stats(bool enable);
+int get_event_stats(struct event_handler_stats **snap);
+int dump_event_stats(int fd);
+int serve_event_stats(const char *path);
+
+static inline bool event_timer_pending(const struct event_timer *t)
+{
+	return t->idx >= 0;
+}
 
 #endif
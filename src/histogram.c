@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2015 Yoonki Kim <klustree@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "histogram.h"
+
+/* Returns the highest value counted in the bucket idx */
+uint64_t hist_bucket_value(int idx)
+{
+	int shift;
+
+	if (idx < HIST_SUB)
+		return idx;
+
+	shift = idx / HIST_SUB - 1;
+	return (((uint64_t)(idx % HIST_SUB + HIST_SUB) + 1) << shift) - 1;
+}
+
+/* percentile is between 0 and 100 */
+uint64_t hist_percentile(const struct histogram *h, double percentile)
+{
+	uint64_t target, seen = 0;
+	int i;
+
+	if (!h->count)
+		return 0;
+
+	target = h->count * percentile / 100;
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < HIST_NR_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			break;
+	}
+	if (i == HIST_NR_BUCKETS)
+		return h->max;
+
+	/* never report more than what was seen */
+	return hist_bucket_value(i) < h->max ? hist_bucket_value(i) : h->max;
+}
+
+void hist_merge(struct histogram *dst, const struct histogram *src)
+{
+	int i;
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	for (i = 0; i < HIST_NR_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+void hist_dump(FILE *fp, const char *name, const struct histogram *h)
+{
+	fprintf(fp, "%s count %" PRIu64 " sum %" PRIu64 " mean %" PRIu64
+		" p50 %" PRIu64 " p99 %" PRIu64 " p999 %" PRIu64
+		" max %" PRIu64 "\n", name, h->count, h->sum,
+		h->count ? h->sum / h->count : 0,
+		hist_percentile(h, 50), hist_percentile(h, 99),
+		hist_percentile(h, 99.9), h->max);
+}
@@ -0,0 +1,58 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Log-linear histogram in the style of HdrHistogram
+ *
+ * Values below HIST_SUB are counted exactly.  Above that, every power of two
+ * is split into HIST_SUB linear buckets, so the relative error stays below
+ * 1 / HIST_SUB.  Values of 2^HIST_MAX_BITS and more land in the last bucket.
+ *
+ * Recording is not atomic; a histogram has a single writer and readers
+ * copy it and accept slightly torn snapshots.
+ */
+#define HIST_SUB_BITS		3
+#define HIST_SUB		(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS		40
+#define HIST_NR_BUCKETS		((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint32_t buckets[HIST_NR_BUCKETS];
+};
+
+static inline int hist_index(uint64_t value)
+{
+	int msb, shift;
+
+	if (value < HIST_SUB)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+	if (msb >= HIST_MAX_BITS)
+		return HIST_NR_BUCKETS - 1;
+
+	shift = msb - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (int)((value >> shift) - HIST_SUB);
+}
+
+static inline void hist_record(struct histogram *h, uint64_t value)
+{
+	h->count++;
+	h->sum += value;
+	if (value > h->max)
+		h->max = value;
+	h->buckets[hist_index(value)]++;
+}
+
+uint64_t hist_bucket_value(int idx);
+uint64_t hist_percentile(const struct histogram *h, double percentile);
+void hist_merge(struct histogram *dst, const struct histogram *src);
+void hist_dump(FILE *fp, const char *name, const struct histogram *h);
+
+#endif
@@ -33,7 +33,7 @@
 
 
 static int create_listen_ports(const char *bindaddr, int port, int protocol,
-		int (*callback)(int fd, void *), void *data)
+		bool reuseport, int (*callback)(int fd, void *), void *data)
 {
 	char servname[64];
 	int fd, ret, opt;
@@ -62,6 +62,17 @@ static int create_listen_ports(const char *bindaddr, int port, int protocol,
 		if (ret) 
 			bs_err("failed to set SO_REUSEADDR: %m");
 
+		if (reuseport) {
+			opt = 1;
+			ret = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt,
+					 sizeof(opt));
+			if (ret) {
+				bs_err("failed to set SO_REUSEPORT: %m");
+				close(fd);
+				continue;
+			}
+		}
+
 		opt = 1;
 		if (res->ai_family == AF_INET6) {
 			ret = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
@@ -104,13 +115,27 @@ static int create_listen_ports(const char *bindaddr, int port, int protocol,
 int create_tcp_listen_ports(const char *bindaddr, int port,
 		int (*callback)(int fd, void *), void *data)
 {
-	return create_listen_ports(bindaddr, port, SOCK_STREAM, callback, data);
+	return create_listen_ports(bindaddr, port, SOCK_STREAM, false,
+				   callback, data);
+}
+
+/*
+ * Same as create_tcp_listen_ports() but with SO_REUSEPORT set, so it can be
+ * called once per reactor and the kernel spreads incoming connections over
+ * the listening sockets.
+ */
+int create_tcp_reuseport_listen_ports(const char *bindaddr, int port,
+		int (*callback)(int fd, void *), void *data)
+{
+	return create_listen_ports(bindaddr, port, SOCK_STREAM, true,
+				   callback, data);
 }
 
 int create_udp_listen_ports(const char *bindaddr, int port,
 		int (*callback)(int fd, void *), void *data)
 {
-	return create_listen_ports(bindaddr, port, SOCK_DGRAM, callback, data);
+	return create_listen_ports(bindaddr, port, SOCK_DGRAM, false,
+				   callback, data);
 }
 
 int connect_to(const char *name, int port)
@@ -419,12 +444,12 @@ int get_local_addr(uint8_t *bytes)
 			memset(bytes, 0, 12);
 			memcpy(bytes + 12, &sin->sin_addr, 4);
 			memcpy(bytes + 12, &sin->sin_addr, 4);
-			mi_notice("found IPv4 address");
+			bs_notice("found IPv4 address");
 			goto out;
 		case AF_INET6:
 			sin6 = (struct sockaddr_in6 *)ifa->ifa_addr;
 			memcpy(bytes, &sin6->sin6_addr, 16);
-			mi_notice("found IPv6 address");
+			bs_notice("found IPv6 address");
 			goto out;
 		}
 	}
@@ -53,6 +53,8 @@ int tx(struct connection *conn, enum conn_state next_state);
 int connect_to(const char *name, int port);
 int create_tcp_listen_ports(const char *bindaddr, int port,
 		int (*callback)(int fd, void *), void *data);
+int create_tcp_reuseport_listen_ports(const char *bindaddr, int port,
+		int (*callback)(int fd, void *), void *data);
 int create_unix_domain_socket(const char *unix_path,
 			      int (*callback)(int, void *), void *data);
 
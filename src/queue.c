@@ -13,80 +13,843 @@
 #include <stdint.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/epoll.h>
 
 #include "util.h"
 #include "event.h"
 #include "queue.h"
 
+/*
+ * Ring of the ring modes, rounded up to a power of two, of which at most
+ * limit entries are used.  The producer and the consumer side each own a
+ * cache line.
+ *
+ * Q_SPSC: the producer only writes tail and the consumer only head; each
+ * keeps a copy of the other's index and rereads it only when the ring looks
+ * full, or empty.
+ *
+ * Q_MPSC: producers claim a slot by a CAS on tail and publish it with its
+ * seq as in Vyukov's bounded queue, the consumer hands the slot over to the
+ * next lap likewise.
+ */
+struct q_slot {
+	uint64_t seq;
+	void *data;
+};
+
+struct q_ring {
+	uint64_t mask;
+	uint64_t limit;
+
+	uint64_t tail __cacheline_aligned;
+	uint64_t head_cache;
+
+	uint64_t head __cacheline_aligned;
+	uint64_t tail_cache;
+
+	/* producers waiting for room */
+	struct bs_eventcount space_ec __cacheline_aligned;
+
+	struct q_slot slots[];
+};
+
+/*
+ * Free elements of a queue.  A thread takes them Q_CACHE_BATCH at a time
+ * into a cache of its own and gives them back likewise, so allocating and
+ * freeing an element takes no lock most of the time.  The pool grows by
+ * Q_POOL_CHUNK elements and never shrinks.
+ */
+#define Q_POOL_CHUNK	128
+#define Q_CACHE_BATCH	32
+#define Q_NR_CACHES	8
+
+struct q_pool {
+	struct bs_mutex lock;
+	struct list_node *free;		/* linked through next */
+	unsigned int nr_free;
+};
+
+/* A thread's cache of one pool; pools sharing a slot evict each other */
+struct q_cache {
+	struct q_pool *pool;
+	struct list_node *free;
+	unsigned int nr;
+};
+
+static __thread struct q_cache q_caches[Q_NR_CACHES];
+static __thread bool q_caches_used;
+static pthread_key_t q_cache_key;
+static pthread_once_t q_cache_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Notification is coalesced: only the q_notify() which finds notified clear
+ * writes the eventfd, and the handler clears it after the callback has
+ * drained the queue.  Entries queued meanwhile are either seen by the
+ * callback or found by the recheck below, which arms the eventfd again.
+ */
 static void q_handler(int fd, int events, void *data)
 {
 	struct queue *q = data;
+	struct q_batch batch;
+
+	eventfd_xread(fd);
+
+	batch.hint = uatomic_xchg(&q->nr_notified, 0);
+	if (q->batch_callback) {
+		batch.q = q;
+		batch.max = q->batch_max ? q->batch_max : UINT_MAX;
+		batch.nr = 0;
+		q->batch_callback(&batch, q->data);
+	} else
+		q->notify_callback(q->data);
+
+	uatomic_set(&q->notified, false);
+	smp_mb();
+	/* left over by a bounded batch, or queued before notified was clear */
+	if (!q_empty(q) && !uatomic_xchg(&q->notified, true))
+		eventfd_xwrite(fd, 1);
+}
+
+static void q_init_notify(struct queue *q)
+{
+	q->efd = eventfd(0, 0);
+	if (q->efd == -1) {
+		abort();
+	}
+
+	if (register_event(q->efd, q_handler, q) < 0) {
+		abort();
+	}
+}
+
+static struct q_ring *q_alloc_ring(unsigned int limit)
+{
+	struct q_ring *ring;
+	uint64_t i, size = 1;
+
+	while (size < limit)
+		size <<= 1;
+
+	if (posix_memalign((void **)&ring, CACHELINE_SIZE,
+			   sizeof(*ring) + size * sizeof(ring->slots[0])))
+		panic("Out of memory");
+	memset(ring, 0, sizeof(*ring));
+	ring->mask = size - 1;
+	ring->limit = limit;
+	for (i = 0; i < size; i++) {
+		ring->slots[i].seq = i;
+		ring->slots[i].data = NULL;
+	}
+
+	return ring;
+}
+
+static bool spsc_push(struct q_ring *ring, void *data)
+{
+	uint64_t pos = ring->tail;
+
+	if (pos - ring->head_cache >= ring->limit) {
+		ring->head_cache = smp_load_acquire(&ring->head);
+		if (pos - ring->head_cache >= ring->limit)
+			return false;
+	}
+
+	ring->slots[pos & ring->mask].data = data;
+	smp_store_release(&ring->tail, pos + 1);
+	return true;
+}
+
+static void *spsc_pop(struct q_ring *ring)
+{
+	uint64_t pos = ring->head;
+	void *data;
+
+	if (pos == ring->tail_cache) {
+		ring->tail_cache = smp_load_acquire(&ring->tail);
+		if (pos == ring->tail_cache)
+			return NULL;
+	}
+
+	data = ring->slots[pos & ring->mask].data;
+	smp_store_release(&ring->head, pos + 1);
+	return data;
+}
+
+static bool mpsc_push(struct q_ring *ring, void *data)
+{
+	struct q_slot *slot;
+	uint64_t pos, seq;
+
+	pos = uatomic_read(&ring->tail);
+	for (;;) {
+		if (pos - smp_load_acquire(&ring->head) >= ring->limit) {
+			/* full, unless pos went stale meanwhile */
+			seq = uatomic_read(&ring->tail);
+			if (seq == pos)
+				return false;
+			pos = seq;
+			continue;
+		}
+
+		slot = &ring->slots[pos & ring->mask];
+		seq = smp_load_acquire(&slot->seq);
+		if (seq == pos) {
+			if (uatomic_cmpxchg(&ring->tail, pos, pos + 1) == pos)
+				break;
+		} else if (seq < pos)
+			return false;
+		pos = uatomic_read(&ring->tail);
+	}
+
+	slot->data = data;
+	smp_store_release(&slot->seq, pos + 1);
+	return true;
+}
+
+static void *mpsc_pop(struct q_ring *ring)
+{
+	uint64_t pos = ring->head;
+	struct q_slot *slot = &ring->slots[pos & ring->mask];
+	void *data;
+
+	if (smp_load_acquire(&slot->seq) != pos + 1)
+		return NULL;
+
+	data = slot->data;
+	smp_store_release(&slot->seq, pos + ring->mask + 1);
+	smp_store_release(&ring->head, pos + 1);
+	return data;
+}
+
+static bool ring_push(struct queue *q, void *data)
+{
+	if (q->mode == Q_SPSC)
+		return spsc_push(q->ring, data);
+	return mpsc_push(q->ring, data);
+}
+
+static uint64_t get_msec_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Entries queued now */
+static unsigned int q_count(struct queue *q)
+{
+	struct q_ring *ring = q->ring;
+
+	if (q->mode == Q_LIST)
+		return uatomic_read(&q->count);
+
+	return uatomic_read(&ring->tail) - uatomic_read(&ring->head);
+}
+
+/*
+ * Called after every change of the count while watermarks are set.  The
+ * crossings are rechecked under wm_lock, so on_high() and on_low() always
+ * alternate and the last one called matches the count, however producers
+ * and the consumer race.
+ */
+static void q_update_watermarks(struct queue *q)
+{
+	unsigned int count;
+	bool above;
+
+	if (likely(!uatomic_read(&q->high_wm)))
+		return;
+
+	/* pairs with the one of the other side, see below */
+	smp_mb();
+	count = q_count(q);
+	above = uatomic_read(&q->above);
+	if (above ? count > q->low_wm : count < q->high_wm)
+		return;
+
+	bs_mutex_lock(&q->wm_lock);
+	for (;;) {
+		count = q_count(q);
+		if (!q->above && count >= q->high_wm) {
+			uatomic_set(&q->above, true);
+			q->tm_above = get_msec_time();
+			q->nr_high++;
+			if (q->on_high)
+				q->on_high(q->data);
+		} else if (q->above && count <= q->low_wm) {
+			uatomic_set(&q->above, false);
+			q->time_above += get_msec_time() - q->tm_above;
+			if (q->on_low)
+				q->on_low(q->data);
+		} else
+			break;
+		/*
+		 * A side which changed the count meanwhile may have checked
+		 * the old state and left, so look at the count again.
+		 */
+		smp_mb();
+	}
+	bs_mutex_unlock(&q->wm_lock);
+}
+
+/*
+ * Apply the full policy to an entry which found no room.  Returns 0 if it
+ * was dropped, -1 if rejected, or 1 if the caller should wait.
+ */
+static int q_full(struct queue *q, void *entry, bool may_wait)
+{
+	switch (q->full_policy) {
+	case Q_FULL_DROP:
+		uatomic_inc(&q->nr_dropped);
+		if (q->drop)
+			q->drop(entry);
+		return 0;
+	case Q_FULL_WAIT:
+		if (may_wait)
+			return 1;
+		/* fall through */
+	default:
+		uatomic_inc(&q->nr_rejected);
+		return -1;
+	}
+}
+
+/*
+ * Queue data to a ring mode queue.  If the queue holds limit entries
+ * already, Q_FULL_WAIT waits up to timeout ms for room, forever if
+ * negative.  Returns 0 on success, or -1 with errno EAGAIN when rejected
+ * at once, ETIMEDOUT after waiting and EINVAL for a list mode queue.  data
+ * must not be NULL.  Notifying the consumer is left to the caller, see
+ * q_notify().
+ */
+int q_push(struct queue *q, void *data, int timeout)
+{
+	struct q_ring *ring = q->ring;
+	uint64_t deadline = 0;
+	int64_t left = -1;
+	uint32_t key;
 	int ret;
 
-	ret = eventfd_xread(fd);
+	if (unlikely(q->mode == Q_LIST)) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	q->notify_callback(q->data);
-	
+	if (likely(ring_push(q, data)))
+		goto out;
+	ret = q_full(q, data, timeout != 0);
+	if (ret <= 0) {
+		if (ret < 0)
+			errno = EAGAIN;
+		return ret;
+	}
+	if (timeout > 0)
+		deadline = get_msec_time() + timeout;
+
+	for (;;) {
+		key = bs_ec_prepare_wait(&ring->space_ec);
+		if (ring_push(q, data)) {
+			bs_ec_cancel_wait(&ring->space_ec);
+			break;
+		}
+		if (timeout > 0) {
+			left = deadline - get_msec_time();
+			if (left <= 0) {
+				bs_ec_cancel_wait(&ring->space_ec);
+				uatomic_inc(&q->nr_rejected);
+				errno = ETIMEDOUT;
+				return -1;
+			}
+		}
+		bs_ec_wait(&ring->space_ec, key, left);
+	}
+out:
+	q_update_watermarks(q);
+	return 0;
+}
+
+/*
+ * Take the oldest data from a ring mode queue, NULL if it's empty, or with
+ * errno EINVAL for a list mode queue.
+ */
+void *q_pop(struct queue *q)
+{
+	struct q_ring *ring = q->ring;
+	uint64_t used;
+	void *data;
+
+	if (unlikely(q->mode == Q_LIST)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (q->mode == Q_SPSC) {
+		data = spsc_pop(ring);
+		/* the copy of tail gives a lower bound */
+		used = ring->tail_cache - ring->head;
+		if (used <= ring->limit / 2)
+			used = smp_load_acquire(&ring->tail) - ring->head;
+	} else {
+		data = mpsc_pop(ring);
+		used = uatomic_read(&ring->tail) - ring->head;
+	}
+
+	/*
+	 * Wake the producers waiting for room once the ring is half empty
+	 * rather than at every entry, so that they don't sleep again right
+	 * away.  Costs no system call unless one waits.
+	 */
+	if (data && used <= ring->limit / 2)
+		bs_ec_notify(&ring->space_ec, INT_MAX);
+	if (data)
+		q_update_watermarks(q);
+
+	return data;
 }
 
 struct queue* q_init(unsigned int limit,
 		void (*notify_callback)(void *), void *data)
+{
+	return q_init_ring(limit, Q_LIST, notify_callback, data);
+}
+
+/*
+ * Create a queue in the given mode.  The ring modes hold at most limit
+ * entries, which must not be 0, and are used with q_push() and q_pop()
+ * instead of the element functions.
+ */
+struct queue *q_init_ring(unsigned int limit, enum q_mode mode,
+			  void (*notify_callback)(void *), void *data)
 {
 	struct queue *q;
 
+	if (mode != Q_LIST && limit == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
 	q = xcalloc(1, sizeof(struct queue));
+	q->mode = mode;
+	/* see q_set_full_policy() */
+	q->full_policy = mode == Q_LIST ? Q_FULL_REJECT : Q_FULL_WAIT;
+	if (mode != Q_LIST)
+		q->ring = q_alloc_ring(limit);
 	INIT_LIST_HEAD(&q->pending_list);
 	
 	bs_init_mutex(&q->pending_lock);
 	bs_cond_init(&q->pending_cond);
+	bs_init_mutex(&q->wm_lock);
 
 	q->notify_callback = notify_callback;
 	q->data = data;
 	q->limit = limit;
+	q->efd = -1;
 
-	if (notify_callback) {
-		q->efd = eventfd(0, 0);
-		if (q->efd == -1) {
-			abort();
-		}
+	if (notify_callback)
+		q_init_notify(q);
 
-		if (register_event(q->efd, q_handler, q) < 0) {
-			abort();
-		}
+	return q;
+}
+
+static struct q_pool *q_get_pool(struct queue *q)
+{
+	struct q_pool *pool, *old;
+
+	pool = smp_load_acquire(&q->pool);
+	if (likely(pool))
+		return pool;
+
+	pool = xcalloc(1, sizeof(*pool));
+	bs_init_mutex(&pool->lock);
+
+	old = uatomic_cmpxchg(&q->pool, NULL, pool);
+	if (old) {
+		/* lost the race */
+		bs_destroy_mutex(&pool->lock);
+		free(pool);
+		return old;
 	}
 
-	return q;
+	return pool;
+}
+
+/* Give the nr first elements of the cache back to its pool */
+static void q_cache_flush(struct q_cache *c, unsigned int nr)
+{
+	struct q_pool *pool = c->pool;
+	struct list_node *first = c->free, *last = first;
+	unsigned int i;
+
+	if (!nr)
+		return;
+
+	for (i = 1; i < nr; i++)
+		last = last->next;
+	c->free = last->next;
+	c->nr -= nr;
+
+	bs_mutex_lock(&pool->lock);
+	last->next = pool->free;
+	pool->free = first;
+	pool->nr_free += nr;
+	bs_mutex_unlock(&pool->lock);
+}
+
+static void q_cache_exit(void *arg)
+{
+	int i;
+
+	for (i = 0; i < Q_NR_CACHES; i++) {
+		if (q_caches[i].pool)
+			q_cache_flush(&q_caches[i], q_caches[i].nr);
+		q_caches[i].pool = NULL;
+	}
+}
+
+static void q_cache_key_init(void)
+{
+	if (pthread_key_create(&q_cache_key, q_cache_exit))
+		panic("failed to create a key, %m");
+}
+
+static struct q_cache *q_get_cache(struct q_pool *pool)
+{
+	struct q_cache *c;
+
+	c = &q_caches[((uintptr_t)pool / sizeof(*pool)) % Q_NR_CACHES];
+	if (likely(c->pool == pool))
+		return c;
+
+	if (c->pool)
+		q_cache_flush(c, c->nr);
+	c->pool = pool;
+
+	if (!q_caches_used) {
+		/* flush the caches when the thread exits */
+		pthread_once(&q_cache_once, q_cache_key_init);
+		pthread_setspecific(q_cache_key, q_caches);
+		q_caches_used = true;
+	}
+
+	return c;
+}
+
+static void q_cache_refill(struct q_cache *c)
+{
+	struct q_pool *pool = c->pool;
+	struct list_node *last;
+	struct element *chunk;
+	unsigned int i, nr;
+
+	bs_mutex_lock(&pool->lock);
+	nr = min(pool->nr_free, (unsigned int)Q_CACHE_BATCH);
+	if (nr) {
+		c->free = last = pool->free;
+		for (i = 1; i < nr; i++)
+			last = last->next;
+		pool->free = last->next;
+		last->next = NULL;
+		pool->nr_free -= nr;
+	}
+	bs_mutex_unlock(&pool->lock);
+
+	if (nr) {
+		c->nr = nr;
+		return;
+	}
+
+	chunk = xmalloc(Q_POOL_CHUNK * sizeof(*chunk));
+	for (i = 0; i < Q_POOL_CHUNK; i++)
+		chunk[i].e_list.next = i + 1 < Q_POOL_CHUNK ?
+			&chunk[i + 1].e_list : NULL;
+	c->free = &chunk[0].e_list;
+	c->nr = Q_POOL_CHUNK;
+}
+
+/*
+ * Allocate an element wrapping data from the pool of the queue.  Meant for
+ * producers which would malloc() an element for each q_add().
+ */
+struct element *q_alloc_element(struct queue *q, void *data)
+{
+	struct q_cache *c = q_get_cache(q_get_pool(q));
+	struct element *elem;
+
+	if (unlikely(!c->nr))
+		q_cache_refill(c);
+
+	elem = list_entry(c->free, struct element, e_list);
+	c->free = elem->e_list.next;
+	c->nr--;
+
+	INIT_LIST_NODE(&elem->e_list);
+	elem->data = data;
+	elem->q = q;
+	return elem;
+}
+
+/*
+ * Free an element of q_alloc_element(), after q_del() if it was queued.
+ * Any thread may free it.
+ */
+void q_free_element(struct element *elem)
+{
+	struct q_cache *c = q_get_cache(q_get_pool(elem->q));
+
+	elem->e_list.next = c->free;
+	c->free = &elem->e_list;
+	if (unlikely(++c->nr >= 2 * Q_CACHE_BATCH))
+		q_cache_flush(c, Q_CACHE_BATCH);
 }
 
 bool q_empty(struct queue *q)
 {
-	return list_empty(&q->pending_list);
+	struct q_ring *ring = q->ring;
+	uint64_t pos;
+
+	switch (q->mode) {
+	case Q_SPSC:
+		return uatomic_read(&ring->head) == uatomic_read(&ring->tail);
+	case Q_MPSC:
+		pos = uatomic_read(&ring->head);
+		return smp_load_acquire(&ring->slots[pos & ring->mask].seq) !=
+			pos + 1;
+	default:
+		return uatomic_read(&q->count) == 0;
+	}
+}
+
+/*
+ * Queue a list_node embedded in the caller's object to a list mode queue,
+ * which saves wrapping it into an element.  A limit of 0 means no limit;
+ * otherwise a full queue applies its policy, see q_set_full_policy():
+ * rejecting by default, Q_FULL_WAIT waiting as long as it takes and
+ * Q_FULL_DROP passing the node to drop.  Returns 0 on success, or -1 with
+ * errno EAGAIN if rejected, EINVAL for a ring mode queue.
+ */
+int q_add_node(struct queue *q, struct list_node *node)
+{
+	int ret;
+
+	if (unlikely(q->mode != Q_LIST)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bs_mutex_lock(&q->pending_lock);
+	while (q->limit && q->count >= q->limit) {
+		ret = q_full(q, node, true);
+		if (ret <= 0) {
+			bs_mutex_unlock(&q->pending_lock);
+			if (ret < 0)
+				errno = EAGAIN;
+			return ret;
+		}
+		bs_cond_wait(&q->pending_cond, &q->pending_lock);
+	}
+	list_add_tail(node, &q->pending_list);
+	uatomic_inc(&q->count);
+	bs_mutex_unlock(&q->pending_lock);
+
+	q_update_watermarks(q);
+	return 0;
+}
+
+/*
+ * Take the oldest node off a list mode queue, NULL if it's empty, or with
+ * errno EINVAL for a ring mode queue.
+ */
+struct list_node *q_pop_node(struct queue *q)
+{
+	struct list_node *node = NULL;
+
+	if (unlikely(q->mode != Q_LIST)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	bs_mutex_lock(&q->pending_lock);
+	if (!list_empty(&q->pending_list)) {
+		node = q->pending_list.n.next;
+		list_del(node);
+		uatomic_dec(&q->count);
+		bs_cond_signal(&q->pending_cond);
+	}
+	bs_mutex_unlock(&q->pending_lock);
+
+	if (node)
+		q_update_watermarks(q);
+	return node;
+}
+
+void q_del_node(struct queue *q, struct list_node *node)
+{
+	bs_mutex_lock(&q->pending_lock);
+	list_del(node);
+	uatomic_dec(&q->count);
+	bs_cond_signal(&q->pending_cond);
+	bs_mutex_unlock(&q->pending_lock);
+
+	q_update_watermarks(q);
 }
 
-void q_add(struct queue *q, struct element *elem)
+/*
+ * Queue an element to a list mode queue.  Returns 0, or -1 with errno set
+ * if the queue is full or in a ring mode, see q_add_node().
+ */
+int q_add(struct queue *q, struct element *elem)
 {
-	list_add_tail(&elem->e_list, &q->pending_list);
+	elem->q = q;
+	return q_add_node(q, &elem->e_list);
 }
 
+/*
+ * The oldest element of a list mode queue, NULL if it's empty, or with
+ * errno EINVAL for a ring mode queue.
+ */
 struct element* q_first_entry(struct queue *q)
 {
-	struct element *element;
+	struct element *element = NULL;
+
+	if (unlikely(q->mode != Q_LIST)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	bs_mutex_lock(&q->pending_lock);
+	if (!list_empty(&q->pending_list))
+		element = list_first_entry(&q->pending_list, struct element,
+					   e_list);
+	bs_mutex_unlock(&q->pending_lock);
 
-	element = list_first_entry(&q->pending_list, struct element, e_list);
 	return element;
 }
 
 void q_del(struct element *elem)
 {
-	list_del(&elem->e_list);
+	q_del_node(elem->q, &elem->e_list);
+}
+
+/*
+ * Call on_high(data) when the count reaches high and on_low(data) when it
+ * falls back to low, e.g. to stop and restart reading from a connection.
+ * The callbacks may run on any thread queueing or taking entries, one at a
+ * time and under an internal lock, so they should be short.  high 0
+ * disables the watermarks.
+ */
+int q_set_watermarks(struct queue *q, unsigned int high, unsigned int low,
+		     void (*on_high)(void *), void (*on_low)(void *))
+{
+	if (high && low >= high) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bs_mutex_lock(&q->wm_lock);
+	q->on_high = on_high;
+	q->on_low = on_low;
+	q->low_wm = low;
+	uatomic_set(&q->high_wm, high);
+	bs_mutex_unlock(&q->wm_lock);
+
+	/* the count may be past either already */
+	q_update_watermarks(q);
+	return 0;
+}
+
+/*
+ * Choose what queueing to a full queue does.  Ring mode queues default to
+ * Q_FULL_WAIT, list mode queues to Q_FULL_REJECT so that q_add() never
+ * blocks unless asked to, e.g. in a handler feeding its own queue.
+ * Q_FULL_DROP passes the entry, the data of q_push() or the element of
+ * q_add(), to drop if it's not NULL and reports success.
+ */
+void q_set_full_policy(struct queue *q, enum q_full_policy policy,
+		       void (*drop)(void *))
+{
+	q->drop = drop;
+	uatomic_set(&q->full_policy, policy);
 }
 
+void q_get_stats(struct queue *q, struct q_stats *stats)
+{
+	bs_mutex_lock(&q->wm_lock);
+	stats->count = q_count(q);
+	stats->nr_rejected = uatomic_read(&q->nr_rejected);
+	stats->nr_dropped = uatomic_read(&q->nr_dropped);
+	stats->nr_high = q->nr_high;
+	stats->time_above = q->time_above;
+	if (q->above)
+		stats->time_above += get_msec_time() - q->tm_above;
+	bs_mutex_unlock(&q->wm_lock);
+}
+
+/*
+ * Tell the consumer that count entries were queued.  Costs no system call
+ * while the consumer is armed or draining already, nothing at all for a
+ * queue without a callback.
+ */
 void q_notify(struct queue *q, int count)
 {
+	if (unlikely(q->efd < 0))
+		return;
+
+	uatomic_add(&q->nr_notified, count);
+	if (uatomic_read(&q->notified) || uatomic_xchg(&q->notified, true))
+		return;
+
 	eventfd_xwrite(q->efd, count);
 }
 
+/*
+ * Call fn(batch, data) instead of notify_callback when the queue is
+ * notified.  fn takes entries with q_batch_next(), up to max per call if
+ * max isn't 0; it's called again later for the rest.  Must be called from
+ * the main thread.
+ */
+int q_set_batch_callback(struct queue *q, q_batch_callback_t fn,
+			 unsigned int max)
+{
+	if (!fn) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	q->batch_max = max;
+	q->batch_callback = fn;
+	if (q->efd < 0)
+		q_init_notify(q);
+
+	return 0;
+}
+
+/*
+ * Take the next entry of a batch: the data of a ring mode queue, or the
+ * node of a list mode queue, already deleted, which is the element itself
+ * for q_add().  NULL once the queue is empty or the batch is complete.
+ */
+void *q_batch_next(struct q_batch *batch)
+{
+	struct queue *q = batch->q;
+	void *entry;
+
+	if (batch->nr >= batch->max)
+		return NULL;
+
+	if (q->mode == Q_LIST) {
+		/* an element of q_add() is at the address of its e_list */
+		BUILD_BUG_ON(offsetof(struct element, e_list) != 0);
+		entry = q_pop_node(q);
+	} else
+		entry = q_pop(q);
+
+	if (entry)
+		batch->nr++;
+	return entry;
+}
+
 int q_notify_off(struct queue *q)
 {
 	modify_event(q->efd, ~EPOLLIN);
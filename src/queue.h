@@ -3,6 +3,53 @@
 
 #include "list.h"
 
+/*
+ * A queue is a list of elements by default.  The ring modes hand over data
+ * pointers through a fixed ring of limit entries instead, without any
+ * struct element or allocation per entry.
+ */
+enum q_mode {
+	Q_LIST,
+	Q_SPSC,		/* one producer thread, one consumer thread */
+	Q_MPSC,		/* any producer threads, one consumer thread */
+};
+
+/*
+ * What queueing to a queue holding limit entries already does; the default
+ * is Q_FULL_WAIT for the ring modes and Q_FULL_REJECT for Q_LIST.
+ */
+enum q_full_policy {
+	Q_FULL_WAIT,	/* wait for room, up to the timeout of q_push() */
+	Q_FULL_REJECT,	/* fail at once */
+	Q_FULL_DROP,	/* discard the entry, see q_set_full_policy() */
+};
+
+struct q_stats {
+	unsigned int count;	/* entries queued now */
+	uint64_t nr_rejected;	/* entries refused for lack of room */
+	uint64_t nr_dropped;	/* entries discarded by Q_FULL_DROP */
+	uint64_t nr_high;	/* times the high watermark was reached */
+	uint64_t time_above;	/* ms spent at or above it */
+};
+
+struct q_ring;
+struct q_pool;
+struct queue;
+
+/*
+ * Handed to the batch callback of a queue, see q_set_batch_callback().
+ * hint is what the eventfd counter would read had every q_notify() written
+ * it, i.e. the sum of their counts since the last drain.
+ */
+struct q_batch {
+	struct queue *q;
+	unsigned int hint;
+	unsigned int max;	/* entries q_batch_next() returns at most */
+	unsigned int nr;	/* entries it returned so far */
+};
+
+typedef void (*q_batch_callback_t)(struct q_batch *batch, void *data);
+
 struct queue {
 	struct bs_cond pending_cond;
 	struct bs_mutex pending_lock;
@@ -10,22 +57,76 @@ struct queue {
 
 	int efd;
 	void (*notify_callback)(void *);
+	q_batch_callback_t batch_callback;
+	unsigned int batch_max;
+	/* set from the first q_notify() until the consumer has drained */
+	bool notified;
+	unsigned int nr_notified;
 	void *data;
 	int limit;
 	int count;
+
+	int mode;
+	struct q_ring *ring;
+	/*
+	 * Elements of q_alloc_element(), created on first use.  Its memory is
+	 * never freed, so it stays at its peak for the life of the process.
+	 */
+	struct q_pool *pool;
+
+	/* flow control, see q_set_watermarks() */
+	int full_policy;
+	void (*drop)(void *);
+	unsigned int high_wm;
+	unsigned int low_wm;
+	void (*on_high)(void *);
+	void (*on_low)(void *);
+	/* serializes crossings and their callbacks */
+	struct bs_mutex wm_lock;
+	bool above;
+	uint64_t tm_above;
+	uint64_t time_above;
+	uint64_t nr_high;
+	uint64_t nr_rejected;
+	uint64_t nr_dropped;
 };
 
+/*
+ * Wraps data for a list mode queue.  Objects which are queued often can
+ * embed a list_node instead, see q_add_node().  e_list must stay the first
+ * member: q_batch_next() returns the popped node, which is then the
+ * element itself.
+ */
 struct element {
 	struct list_node e_list;
 	void *data;
+	struct queue *q;
 };
 
 struct queue* q_init(unsigned int limit,
 		void (*notify_callback)(void *), void *data);
+struct queue *q_init_ring(unsigned int limit, enum q_mode mode,
+			  void (*notify_callback)(void *), void *data);
 bool q_empty(struct queue *q);
-void q_add(struct queue *q, struct element *elem);
+int q_add(struct queue *q, struct element *elem);
 struct element* q_first_entry(struct queue *q);
 void q_del(struct element *elem);
+/* Pooled elements; the pool only grows, see struct queue */
+struct element *q_alloc_element(struct queue *q, void *data);
+void q_free_element(struct element *elem);
+int q_add_node(struct queue *q, struct list_node *node);
+struct list_node *q_pop_node(struct queue *q);
+void q_del_node(struct queue *q, struct list_node *node);
 void q_notify(struct queue *q, int count);
+int q_push(struct queue *q, void *data, int timeout);
+void *q_pop(struct queue *q);
+int q_set_watermarks(struct queue *q, unsigned int high, unsigned int low,
+		     void (*on_high)(void *), void (*on_low)(void *));
+void q_set_full_policy(struct queue *q, enum q_full_policy policy,
+		       void (*drop)(void *));
+void q_get_stats(struct queue *q, struct q_stats *stats);
+int q_set_batch_callback(struct queue *q, q_batch_callback_t fn,
+			 unsigned int max);
+void *q_batch_next(struct q_batch *batch);
 
 #endif
@@ -3,179 +3,432 @@
 #include <stdint.h>
 #include <time.h>
 #include <errno.h>
-#include <signal.h>
-#include <sys/epoll.h>
-#include <sys/signalfd.h>
-#include <sys/eventfd.h>
-#include <sys/timerfd.h>
 
 #include "util.h"
 #include "event.h"
 #include "timer.h"
 
-static void timer_handler(int fd, int events, void *data)
+/*
+ * Timers live in a hierarchical timing wheel of 1 ms ticks, turned by a
+ * single reactor timer of the main event loop.  Level 0 holds the timers of
+ * the next 256 ticks, one slot per tick; each level above covers 64 times
+ * the span of the one below and is cascaded a slot at a time into the lower
+ * levels as the wheel turns.  Adding and cancelling a timer is a list
+ * operation.  The reactor timer belongs to the main reactor thread, so
+ * other threads post it a request to move it, and only when the nearest
+ * expiry moves closer.
+ */
+#define TW_ROOT_BITS	8
+#define TW_LVL_BITS	6
+#define TW_ROOT_SIZE	(1 << TW_ROOT_BITS)
+#define TW_LVL_SIZE	(1 << TW_LVL_BITS)
+#define TW_ROOT_MASK	(TW_ROOT_SIZE - 1)
+#define TW_LVL_MASK	(TW_LVL_SIZE - 1)
+#define TW_NR_LVLS	4	/* above the root, spanning 2^32 ms */
+
+#define TW_SHIFT(lvl)	(TW_ROOT_BITS + (lvl) * TW_LVL_BITS)
+#define TW_INDEX(clk, lvl) (((clk) >> TW_SHIFT(lvl)) & TW_LVL_MASK)
+
+struct timer_wheel {
+	struct bs_mutex lock;
+	struct event_timer timer;
+	uint64_t base;		/* CLOCK_MONOTONIC ms of tick 0 */
+	uint64_t clk;		/* next tick to run */
+	uint64_t armed;		/* tick the timer fires at, or UINT64_MAX */
+	bool running;		/* tw_run() rearms when done */
+	bool arm_posted;	/* tw_post_arm() is pending */
+	unsigned long nr_timers;
+
+	/* non-empty slots, to find the nearest expiry without a scan */
+	uint64_t root_map[TW_ROOT_SIZE / 64];
+	uint64_t lvl_map[TW_NR_LVLS];
+
+	struct list_head root[TW_ROOT_SIZE];
+	struct list_head lvl[TW_NR_LVLS][TW_LVL_SIZE];
+};
+
+static struct timer_wheel *wheel;
+
+static uint64_t get_msec_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t tw_now(struct timer_wheel *w)
+{
+	return get_msec_time() - w->base;
+}
+
+/* Link t into the slot for its expiry, counted from the current tick */
+static void tw_enqueue(struct timer_wheel *w, struct timer *t)
 {
-	struct signalfd_siginfo fdsi;
-	struct timer *t = data;
+	uint64_t expires = t->expires, delta;
+	unsigned int idx;
+	int lvl;
+
+	if (expires < w->clk)
+		expires = w->clk;
+	delta = expires - w->clk;
 
-	if (read(fd, &fdsi, sizeof(struct signalfd_siginfo)) < 0)
+	if (delta < TW_ROOT_SIZE) {
+		idx = expires & TW_ROOT_MASK;
+		list_add_tail(&t->t_list, &w->root[idx]);
+		w->root_map[idx / 64] |= 1ULL << (idx % 64);
 		return;
+	}
 
-	t->callback(t->data);
-	
-	switch(t->type) {
-		case TIMER_PERIODIC:
-		case TIMER_ABSOLUTE:
-			break;
-		case TIMER_ONESHOT:
-			unregister_event(fd);
-			close(fd);
-			break;
-		default:
+	for (lvl = 0; lvl < TW_NR_LVLS - 1; lvl++)
+		if (delta < 1ULL << TW_SHIFT(lvl + 1))
 			break;
-	}
+	if (delta >= 1ULL << TW_SHIFT(TW_NR_LVLS))
+		expires = w->clk + (1ULL << TW_SHIFT(TW_NR_LVLS)) - 1;
 
+	idx = TW_INDEX(expires, lvl);
+	list_add_tail(&t->t_list, &w->lvl[lvl][idx]);
+	w->lvl_map[lvl] |= 1ULL << idx;
 }
 
-struct timer* create_timer(const char *name, int signo)
+/* Clear the map bit of the slot t was in if t was its last timer */
+static void tw_dequeue(struct timer_wheel *w, struct timer *t)
 {
-	struct sigevent sev;
+	struct list_node *next = t->t_list.next;
+	struct list_head *head;
+	unsigned int idx;
+	int lvl;
+
+	list_del(&t->t_list);
+	if (next != next->next)
+		return;
+
+	/* the slot is empty now; next is its head */
+	head = container_of(next, struct list_head, n);
+	if (head >= w->root && head < w->root + TW_ROOT_SIZE) {
+		idx = head - w->root;
+		w->root_map[idx / 64] &= ~(1ULL << (idx % 64));
+		return;
+	}
+	for (lvl = 0; lvl < TW_NR_LVLS; lvl++) {
+		if (head >= w->lvl[lvl] && head < w->lvl[lvl] + TW_LVL_SIZE) {
+			w->lvl_map[lvl] &= ~(1ULL << (head - w->lvl[lvl]));
+			return;
+		}
+	}
+}
+
+/* Move the timers of a slot above the root down to the lower levels */
+static void tw_cascade(struct timer_wheel *w, int lvl, unsigned int idx)
+{
+	struct list_head *head = &w->lvl[lvl][idx];
 	struct timer *t;
-	
-	t = xcalloc(1, sizeof(*t));
-	t->name = name;
-	
-	sev.sigev_notify = SIGEV_SIGNAL;
-	sev.sigev_signo = t->signo = signo;
-	
-	if (timer_create(CLOCK_REALTIME, &sev, &t->tid) < 0) {
-		panic("failed to create timer");
-		free(t);
-		return NULL;
+
+	w->lvl_map[lvl] &= ~(1ULL << idx);
+	while (!list_empty(head)) {
+		t = list_first_entry(head, struct timer, t_list);
+		list_del(&t->t_list);
+		tw_enqueue(w, t);
 	}
+}
 
-	return t;
+/* First set bit of a 64 bit map at or after bit 'from', cyclically */
+static inline int tw_next_bit(uint64_t map, unsigned int from)
+{
+	uint64_t rot;
+
+	if (!map)
+		return -1;
+	rot = from ? (map >> from) | (map << (64 - from)) : map;
+	return (__builtin_ctzll(rot) + from) % 64;
 }
 
-int add_timer(struct timer *t, enum timer_type type, 
-		unsigned int msec, void (*callback)(void *), void *data)
+/*
+ * The tick the wheel has to run next: the nearest root slot, or the next
+ * cascade of a non-empty slot above it, whichever comes first.  Never later
+ * than the nearest expiry.
+ */
+static uint64_t tw_next_tick(struct timer_wheel *w)
 {
-	struct itimerspec it;
-	sigset_t mask;
-	int sfd;
+	uint64_t next = UINT64_MAX, t, span, map;
+	unsigned int from = w->clk & TW_ROOT_MASK, i, word, pos;
+	int lvl, bit;
 
-	t->type = type;
-	t->callback = callback;
-	t->data = data;
+	/* the words of the root map from the current slot on, and back to it */
+	for (i = 0; i <= TW_ROOT_SIZE / 64; i++) {
+		word = (from / 64 + i) % (TW_ROOT_SIZE / 64);
+		map = w->root_map[word];
+		if (i == 0)
+			map &= ~0ULL << (from % 64);
+		else if (i == TW_ROOT_SIZE / 64)
+			map &= (1ULL << (from % 64)) - 1;
+		if (map) {
+			pos = word * 64 + __builtin_ctzll(map);
+			next = w->clk + ((pos - from) & TW_ROOT_MASK);
+			break;
+		}
+	}
 
-	memset(&it, 0, sizeof(it));
+	for (lvl = 0; lvl < TW_NR_LVLS; lvl++) {
+		if (!w->lvl_map[lvl])
+			continue;
+		span = 1ULL << TW_SHIFT(lvl);
+		/* the slots cascade at multiples of span, from the next one */
+		t = (w->clk + span - 1) / span;
+		bit = tw_next_bit(w->lvl_map[lvl], t & TW_LVL_MASK);
+		t = (t + ((bit - t) & TW_LVL_MASK)) * span;
+		next = min(next, t);
+	}
 
-	/* Inhibit default SIGRTMIN handling */
-	sigemptyset(&mask);
-	sigaddset(&mask, t->signo);
-	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
-		bs_debug("failed to sigprocmask: %m");
-		return -1;
+	return next;
+}
+
+/* Called on the main reactor thread only, which owns w->timer */
+static void tw_arm(struct timer_wheel *w, uint64_t tick)
+{
+	uint64_t now;
+
+	if (tick == w->armed)
+		return;
+
+	w->armed = tick;
+	if (tick == UINT64_MAX) {
+		del_event_timer(&w->timer);
+		return;
 	}
 
-	sfd = signalfd(-1, &mask, 0);
-	if (sfd < 0) {
-		bs_debug("failed to create signal fd");
+	now = tw_now(w);
+	add_event_timer(&w->timer, tick > now ? tick - now : 0);
+}
+
+static void tw_post_arm(void *data)
+{
+	struct timer_wheel *w = data;
+
+	bs_mutex_lock(&w->lock);
+	w->arm_posted = false;
+	tw_arm(w, w->nr_timers ? tw_next_tick(w) : UINT64_MAX);
+	bs_mutex_unlock(&w->lock);
+}
+
+/* Fails with the errno of event_post() if the timer can't be armed */
+static int tw_add(struct timer_wheel *w, struct timer *t, uint64_t expires)
+{
+	t->expires = expires;
+	tw_enqueue(w, t);
+	w->nr_timers++;
+
+	if (w->running || w->arm_posted || expires >= w->armed)
+		return 0;
+
+	if (event_post(get_reactor(0), tw_post_arm, w) < 0) {
+		tw_dequeue(w, t);
+		w->nr_timers--;
 		return -1;
 	}
-	
-	switch (type) {
-		case TIMER_PERIODIC:
-			it.it_value.tv_sec = msec / 1000;
-			it.it_value.tv_nsec = (msec % 1000) * 1000000;
-			it.it_interval.tv_sec = msec / 1000;
-			it.it_interval.tv_nsec = (msec % 1000) * 1000000;
+	w->arm_posted = true;
+
+	return 0;
+}
+
+static void tw_del(struct timer_wheel *w, struct timer *t)
+{
+	if (!list_linked(&t->t_list))
+		return;
+
+	/* a stale expiry costs less than moving the reactor timer */
+	tw_dequeue(w, t);
+	w->nr_timers--;
+}
+
+/*
+ * Run the ticks up to now.  Callbacks are called without the lock, so they
+ * may add, modify, cancel and delete timers, their own included.
+ */
+static void tw_run(void *data)
+{
+	struct timer_wheel *w = data;
+	struct list_head expired;
+	struct timer *t;
+	uint64_t now, next;
+	unsigned int idx;
+	int lvl;
+
+	INIT_LIST_HEAD(&expired);
+	bs_mutex_lock(&w->lock);
+	now = tw_now(w);
+	/* the reactor timer is disarmed once it expired */
+	w->armed = UINT64_MAX;
+	w->running = true;
+	while (w->clk <= now) {
+		if (!w->nr_timers) {
+			w->clk = now + 1;
 			break;
-		case TIMER_ABSOLUTE:
-		case TIMER_ONESHOT:
-			it.it_value.tv_sec = msec / 1000;
-			it.it_value.tv_nsec = (msec % 1000) * 1000000;
+		}
+
+		/* skip the ticks nothing happens at */
+		next = tw_next_tick(w);
+		if (next > now) {
+			w->clk = now + 1;
 			break;
-		default:
-			return -1;
-	}
+		}
+		w->clk = next;
 
-	if (timer_settime(t->tid, 0, &it, NULL) < 0) {
-		bs_debug("timer_settime failed: %m");
-		return -1;
+		idx = w->clk & TW_ROOT_MASK;
+		for (lvl = 0; lvl < TW_NR_LVLS; lvl++) {
+			if (w->clk & ((1ULL << TW_SHIFT(lvl)) - 1))
+				break;
+			tw_cascade(w, lvl, TW_INDEX(w->clk, lvl));
+		}
+
+		list_splice_tail_init(&w->root[idx], &expired);
+		w->root_map[idx / 64] &= ~(1ULL << (idx % 64));
+		w->clk++;
+
+		while (!list_empty(&expired)) {
+			t = list_first_entry(&expired, struct timer, t_list);
+			list_del(&t->t_list);
+			w->nr_timers--;
+			/* rearm first so that the callback may cancel it */
+			if (t->type == TIMER_PERIODIC)
+				tw_add(w, t, max(t->expires + t->interval,
+						 w->clk));
+			bs_mutex_unlock(&w->lock);
+
+			t->callback(t->data);
+
+			bs_mutex_lock(&w->lock);
+		}
+		now = tw_now(w);
 	}
-	
-	if (register_event(sfd, timer_handler, t) < 0) {
-		bs_debug("register_event failed");
-		return -1;
+	w->running = false;
+	tw_arm(w, w->nr_timers ? tw_next_tick(w) : UINT64_MAX);
+	bs_mutex_unlock(&w->lock);
+}
+
+static struct timer_wheel *get_timer_wheel(void)
+{
+	struct timer_wheel *w, *old;
+	int i, j;
+
+	w = smp_load_acquire(&wheel);
+	if (likely(w))
+		return w;
+
+	w = xcalloc(1, sizeof(*w));
+	bs_init_mutex(&w->lock);
+	for (i = 0; i < TW_ROOT_SIZE; i++)
+		INIT_LIST_HEAD(&w->root[i]);
+	for (i = 0; i < TW_NR_LVLS; i++)
+		for (j = 0; j < TW_LVL_SIZE; j++)
+			INIT_LIST_HEAD(&w->lvl[i][j]);
+	w->base = get_msec_time();
+	w->armed = UINT64_MAX;
+	init_event_timer(&w->timer, tw_run, w);
+
+	old = uatomic_cmpxchg(&wheel, NULL, w);
+	if (old) {
+		/* lost the race */
+		bs_destroy_mutex(&w->lock);
+		free(w);
+		return old;
 	}
 
-	return 0;
+	return w;
+}
+
+/*
+ * Create a timer run by the main event loop.  signo is only kept for
+ * compatibility; timers no longer use signals, nor any kernel object of
+ * their own.  Timers can be created before init_event(), but not added.
+ */
+struct timer* create_timer(const char *name, int signo)
+{
+	struct timer *t;
+
+	get_timer_wheel();
+
+	t = xcalloc(1, sizeof(*t));
+	t->name = name;
+	t->signo = signo;
+	INIT_LIST_NODE(&t->t_list);
+
+	return t;
+}
+
+/*
+ * Call callback(data) after msec ms, and every msec ms after that for
+ * TIMER_PERIODIC.  Any thread may add, modify or cancel a timer.  Returns 0,
+ * or -1 with errno set, e.g. EINVAL before init_event() or EAGAIN if the
+ * main reactor has too many posted tasks; the timer isn't pending then.
+ */
+int add_timer(struct timer *t, enum timer_type type,
+		unsigned int msec, void (*callback)(void *), void *data)
+{
+	t->callback = callback;
+	t->data = data;
+
+	return modify_timer(t, type, msec);
 }
 
 int cancle_timer(struct timer *t)
 {
-	struct itimerspec it;
-	
-	it.it_value.tv_sec = 0;
-	it.it_value.tv_nsec = 0;
-	it.it_interval.tv_sec = 0;
-	it.it_interval.tv_nsec = 0;
+	struct timer_wheel *w = get_timer_wheel();
 
-	if (timer_settime(t->tid, 0, &it, NULL) < 0) {
-		bs_debug("timer_settime failed: %m");
-		return -1;
-	}
+	bs_mutex_lock(&w->lock);
+	tw_del(w, t);
+	bs_mutex_unlock(&w->lock);
 
 	return 0;
 }
 
+/*
+ * Restart a timer to expire after msec ms, whether it's pending or not.
+ * Fails like add_timer().
+ */
 int modify_timer(struct timer *t, enum timer_type type, unsigned int msec)
 {
-	struct itimerspec it;
+	struct timer_wheel *w = get_timer_wheel();
+	int ret;
 
-	t->type = type;
-	
 	switch (type) {
 		case TIMER_PERIODIC:
-			it.it_value.tv_sec = msec / 1000;
-			it.it_value.tv_nsec = (msec % 1000) * 1000000;
-			it.it_interval.tv_sec = msec / 1000;
-			it.it_interval.tv_nsec = (msec % 1000) * 1000000;
+			if (!msec) {
+				errno = EINVAL;
+				return -1;
+			}
 			break;
 		case TIMER_ABSOLUTE:
 		case TIMER_ONESHOT:
-			it.it_value.tv_sec = msec / 1000;
-			it.it_value.tv_nsec = (msec % 1000) * 1000000;
 			break;
 		default:
+			errno = EINVAL;
 			return -1;
 	}
 
-	if (timer_settime(t->tid, 0, &it, NULL) < 0) {
-		bs_debug("timer_settime failed: %m");
-		return -1;
-	}
+	bs_mutex_lock(&w->lock);
+	tw_del(w, t);
+	t->type = type;
+	t->interval = msec;
+	ret = tw_add(w, t, max(tw_now(w) + msec, w->clk));
+	bs_mutex_unlock(&w->lock);
 
-	return 0;
+	return ret;
 }
 
+/* Must not race with the callback of the timer, unless called from it */
 void del_timer(struct timer *t)
 {
-	timer_delete(t->tid);
-	unregister_event(t->sfd);
-	close(t->sfd);
+	cancle_timer(t);
 	free(t);
 }
 
 void set_timer_event(struct timer *t, int event)
 {
-	// FIXME : add atomic or lock 
-	t->ev_mask |= event;
+	uatomic_or(&t->ev_mask, event);
 }
 
 void clear_timer_event(struct timer *t, int event)
 {
-	// FIXME : add atomic or lock 
-	t->ev_mask &= ~event;
+	uatomic_and(&t->ev_mask, ~event);
 }
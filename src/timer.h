@@ -1,12 +1,17 @@
 #ifndef __BS_TIMER_H__
 #define __BS_TIMER_H__
 
+#include <stdint.h>
+
+#include "list.h"
+
 enum timer_type {
 	TIMER_PERIODIC,
 	TIMER_ABSOLUTE,
 	TIMER_ONESHOT
 };
 
+/* Only kept for create_timer() callers; timers don't use signals anymore */
 #define TIMER0	SIGRTMIN
 #define TIMER1	SIGRTMIN + 1
 #define TIMER2	SIGRTMIN + 2
@@ -18,11 +23,12 @@ enum timer_type {
 
 struct timer {
 	/* private */
-	timer_t tid;
-	int sfd;
-	
+	struct list_node t_list;
+	uint64_t expires;	/* tick of the timer wheel */
+	unsigned int interval;
+
 	/* public */
-	char *name;
+	const char *name;
 	int signo;
 	int ev_mask;
 	enum timer_type type;
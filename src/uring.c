@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2015 Yoonki Kim <klustree@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "util.h"
+#include "uring.h"
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags,
+			  void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, arg, argsz);
+}
+
+int uring_init(struct uring *u, unsigned int entries, unsigned int cq_entries)
+{
+	struct io_uring_params p;
+	unsigned int i;
+	void *ptr;
+
+	memset(u, 0, sizeof(*u));
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = cq_entries;
+
+	u->fd = io_uring_setup(entries, &p);
+	if (u->fd < 0)
+		return -1;
+
+	/* timed waits need IORING_ENTER_EXT_ARG */
+	u->features = p.features;
+	if (!(p.features & IORING_FEAT_EXT_ARG) ||
+	    !(p.features & IORING_FEAT_NODROP)) {
+		close(u->fd);
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->sq_ring_size = u->cq_ring_size =
+			max(u->sq_ring_size, u->cq_ring_size);
+
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto err_close;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto err_sq;
+	}
+
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto err_cq;
+
+	ptr = u->sq_ring;
+	u->sq_head = ptr + p.sq_off.head;
+	u->sq_tail = ptr + p.sq_off.tail;
+	u->sq_mask = *(unsigned int *)(ptr + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+
+	/* sqes[i] always sits in slot i, so the index array is fixed */
+	for (i = 0; i < p.sq_entries; i++)
+		((unsigned int *)(ptr + p.sq_off.array))[i] = i;
+
+	ptr = u->cq_ring;
+	u->cq_head = ptr + p.cq_off.head;
+	u->cq_tail = ptr + p.cq_off.tail;
+	u->cq_mask = *(unsigned int *)(ptr + p.cq_off.ring_mask);
+	u->cqes = ptr + p.cq_off.cqes;
+
+	return 0;
+err_cq:
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+err_sq:
+	munmap(u->sq_ring, u->sq_ring_size);
+err_close:
+	close(u->fd);
+	return -1;
+}
+
+void uring_exit(struct uring *u)
+{
+	munmap(u->sqes, u->sqes_size);
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_size);
+	munmap(u->sq_ring, u->sq_ring_size);
+	close(u->fd);
+}
+
+/* Queue a copy of sqe; the caller serializes concurrent pushers */
+void uring_push(struct uring *u, const struct io_uring_sqe *sqe)
+{
+	unsigned int tail = *u->sq_tail;
+
+	while (uring_sq_pending(u) == u->sq_entries)
+		uring_submit(u);
+
+	u->sqes[tail & u->sq_mask] = *sqe;
+	smp_store_release(u->sq_tail, tail + 1);
+}
+
+int uring_submit(struct uring *u)
+{
+	int ret;
+
+	do {
+		ret = io_uring_enter(u->fd, uring_sq_pending(u), 0, 0,
+				     NULL, 0);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN ||
+			     errno == EBUSY));
+
+	return ret;
+}
+
+/*
+ * Submit everything queued and wait up to timeout milliseconds (forever if
+ * negative) for at least one completion.  Returns 0 on timeout.
+ */
+int uring_wait(struct uring *u, int timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask_sz = _NSIG / 8;
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000LL;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+
+	ret = io_uring_enter(u->fd, uring_sq_pending(u), 1,
+			     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			     &arg, sizeof(arg));
+	if (ret < 0 && errno == ETIME)
+		return 0;
+
+	return ret;
+}
@@ -0,0 +1,59 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/*
+ * A minimal io_uring wrapper on top of the raw system calls
+ *
+ * Submission entries are filled by uring_push(), which needs to be
+ * serialized by the caller, and handed to the kernel by uring_submit() or
+ * uring_wait().  Completions are consumed with uring_for_each_cqe() and
+ * released with uring_cq_advance(), both from a single thread.
+ */
+struct uring {
+	int fd;
+	unsigned int features;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+int uring_init(struct uring *u, unsigned int entries, unsigned int cq_entries);
+void uring_exit(struct uring *u);
+void uring_push(struct uring *u, const struct io_uring_sqe *sqe);
+int uring_submit(struct uring *u);
+int uring_wait(struct uring *u, int timeout);
+
+static inline unsigned int uring_sq_pending(struct uring *u)
+{
+	return *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+#define uring_for_each_cqe(u, head, cqe)				\
+	for (head = *(u)->cq_head;					\
+	     head != __atomic_load_n((u)->cq_tail, __ATOMIC_ACQUIRE) &&	\
+		     (cqe = &(u)->cqes[head & (u)->cq_mask], 1);	\
+	     head++)
+
+static inline void uring_cq_advance(struct uring *u, unsigned int head)
+{
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+#endif
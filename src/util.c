@@ -60,6 +60,26 @@ void *xcalloc(size_t nmemb, size_t size)
 	return ret;
 }
 
+void *xrealloc(void *ptr, size_t size)
+{
+	void *ret;
+
+	/* realloc(ptr, 0) may free ptr and return NULL */
+	if (unlikely(!size)) {
+		free(ptr);
+		return xmalloc(1);
+	}
+
+	ret = realloc(ptr, size);
+	if (unlikely(!ret)) {
+		try_to_free_routine(size);
+		ret = realloc(ptr, size);
+		if (!ret)
+			panic("Out of memory");
+	}
+	return ret;
+}
+
 static ssize_t _read(int fd, void *buf, size_t len)
 {
 	ssize_t nr;
@@ -155,3 +175,30 @@ void eventfd_xwrite(int efd, int value)
 	if (unlikely(ret < 0))
 		panic("eventfd_write() failed");
 }
+
+/*
+ * Copy the string str to buf.  If str length is bigger than buf_size -
+ * 1 then it is clamped to buf_size - 1.
+ * NOTE: this function does what strncpy should have done to be
+ * useful. NEVER use strncpy.
+ *
+ * @param buf destination buffer
+ * @param buf_size size of destination buffer
+ * @param str source string
+ */
+void pstrcpy(char *buf, int buf_size, const char *str)
+{
+	int c;
+	char *q = buf;
+
+	if (buf_size <= 0)
+		return;
+
+	while (true) {
+		c = *str++;
+		if (c == 0 || q >= buf + buf_size - 1)
+			break;
+		*q++ = c;
+	}
+	*q = '\0';
+}
@@ -11,6 +11,8 @@
 #include <pthread.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <time.h>
 
 #include "list.h"
@@ -52,14 +54,46 @@
 	_x < _y ? -1 : _x > _y ? 1 : 0;	\
 })
 
+/*
+ * Atomic helpers, named after the liburcu uatomic_* API.  All of them are
+ * sequentially consistent; use smp_load_acquire()/smp_store_release() on hot
+ * paths which only need to publish or consume a pointer.
+ */
+#define uatomic_read(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define uatomic_set(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define uatomic_add_return(p, v) __atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define uatomic_sub_return(p, v) __atomic_sub_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define uatomic_add(p, v)	((void)uatomic_add_return(p, v))
+#define uatomic_sub(p, v)	((void)uatomic_sub_return(p, v))
+#define uatomic_inc(p)		uatomic_add(p, 1)
+#define uatomic_dec(p)		uatomic_sub(p, 1)
+#define uatomic_or(p, v)	((void)__atomic_or_fetch((p), (v), __ATOMIC_SEQ_CST))
+#define uatomic_and(p, v)	((void)__atomic_and_fetch((p), (v), __ATOMIC_SEQ_CST))
+#define uatomic_xchg(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+/* Returns the value found at p; the swap happened iff it equals old */
+#define uatomic_cmpxchg(p, old, new)					\
+({									\
+	typeof(*(p)) __old = (old);					\
+	__atomic_compare_exchange_n((p), &__old, (new), false,		\
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);\
+	__old;								\
+})
+
+#define smp_load_acquire(p)	__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define smp_mb()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+
 typedef void (*try_to_free_t)(size_t);
 try_to_free_t set_try_to_free_routine(try_to_free_t);
 void *xmalloc(size_t size);
 void *xcalloc(size_t nmemb, size_t size);
+void *xrealloc(void *ptr, size_t size);
 ssize_t xread(int fd, void *buf, size_t len);
 ssize_t xwrite(int fd, const void *buf, size_t len);
 int eventfd_xread(int efd);
 void eventfd_xwrite(int efd, int value);
+void pstrcpy(char *buf, int buf_size, const char *str);
 
 /* wrapper for pthread_mutex */
 #define BS_MUTEX_INITIALIZER { .mutex = PTHREAD_MUTEX_INITIALIZER }
@@ -74,7 +108,7 @@ static inline void bs_init_mutex(struct bs_mutex *mutex)
 
 	do {
 		ret = pthread_mutex_init(&mutex->mutex, NULL);
-	} while (ret = EAGAIN);
+	} while (ret == EAGAIN);
 
 	if (unlikely(ret != 0))
 		panic("failed to initialize a lock, %s", strerror(ret));
@@ -97,7 +131,7 @@ static inline void bs_mutex_lock(struct bs_mutex *mutex)
 	int ret;
 
 	do {
-		ret = pthread_mutext_lock(&mutex->mutex);
+		ret = pthread_mutex_lock(&mutex->mutex);
 	} while (ret == EAGAIN);
 
 	if (unlikely(ret != 0))
@@ -157,11 +191,76 @@ static inline int bs_cond_wait(struct bs_cond *cond, struct bs_mutex *mutex)
 	return pthread_cond_wait(&cond->cond, &mutex->mutex);
 }
 
+static inline int bs_cond_timedwait(struct bs_cond *cond,
+				    struct bs_mutex *mutex,
+				    const struct timespec *abstime)
+{
+	return pthread_cond_timedwait(&cond->cond, &mutex->mutex, abstime);
+}
+
+static inline int bs_cond_signal(struct bs_cond *cond)
+{
+	return pthread_cond_signal(&cond->cond);
+}
+
 static inline int bs_cond_broadcast(struct bs_cond *cond)
 {
 	return pthread_cond_broadcast(&cond->cond);
 }
 
+/*
+ * Eventcount on a futex.  A waiter announces itself with
+ * bs_ec_prepare_wait() before the last check of its condition and sleeps
+ * only if nobody notified since then, so bs_ec_notify() costs no system
+ * call while nobody sleeps.
+ */
+struct bs_eventcount {
+	uint32_t seq;
+	uint32_t nr_waiters;
+};
+
+static inline uint32_t bs_ec_prepare_wait(struct bs_eventcount *ec)
+{
+	uint32_t key;
+
+	uatomic_inc(&ec->nr_waiters);
+	key = uatomic_read(&ec->seq);
+	/* the caller checks its condition after this */
+	smp_mb();
+	return key;
+}
+
+static inline void bs_ec_cancel_wait(struct bs_eventcount *ec)
+{
+	uatomic_dec(&ec->nr_waiters);
+}
+
+/* Sleep up to timeout ms, forever if negative, unless notified since key */
+static inline void bs_ec_wait(struct bs_eventcount *ec, uint32_t key,
+			      int timeout)
+{
+	struct timespec ts, *tsp = NULL;
+
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		tsp = &ts;
+	}
+	syscall(SYS_futex, &ec->seq, FUTEX_WAIT_PRIVATE, key, tsp, NULL, 0);
+	uatomic_dec(&ec->nr_waiters);
+}
+
+/* Wake up to nr waiters; call after making the condition true */
+static inline void bs_ec_notify(struct bs_eventcount *ec, int nr)
+{
+	smp_mb();
+	if (!uatomic_read(&ec->nr_waiters))
+		return;
+
+	uatomic_inc(&ec->seq);
+	syscall(SYS_futex, &ec->seq, FUTEX_WAKE_PRIVATE, nr, NULL, NULL, 0);
+}
+
 /* wrapper for pthread_rwlock */
 #define BS_RW_LOCK_INITIALIZER	{ .rwlock = PTHREAD_RWLOCK_INITIALIZER }
 
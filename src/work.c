@@ -13,9 +13,11 @@
  *   Copyright (C) 2007 Mike Christie <michaelc@cs.wisc.edu>
  *   Copyright (C) 2009-2011 Nippon Telegraph and Telephone Corporation.
  */
+#include <assert.h>
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <stdio.h>
@@ -27,10 +29,13 @@
 #include <sys/time.h>
 #include <linux/types.h>
 #include <signal.h>
+#include <poll.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
 
 #include "list.h"
 #include "util.h"
-//#include "bitops.h"
+#include "bitops.h"
 #include "work.h"
 #include "event.h"
 
@@ -41,135 +46,1349 @@
  */
 #define WQ_PROTECTION_PERIOD 1000 /* ms */
 
+/*
+ * Default pool bounds: a single worker running the works one at a time and
+ * in order, as callers may rely on.  Pools only grow after
+ * set_work_queue_threads().
+ */
+#define WQ_DEFAULT_MIN_THREADS	1
+#define WQ_DEFAULT_MAX_THREADS	1
+
+/*
+ * Chase-Lev work stealing deque.  The owner pushes and takes works at the
+ * bottom, other workers steal them from the top.
+ */
+#define WQ_DEQUE_SIZE	1024	/* must be a power of two */
+
+struct work_deque {
+	int64_t top __cacheline_aligned;
+	int64_t bottom __cacheline_aligned;
+	struct work *works[WQ_DEQUE_SIZE];
+};
+
+/*
+ * Bounded MPMC ring of pending works (Vyukov's bounded queue).  Works which
+ * don't fit go to the overflow list of the lane under pending_lock, and so
+ * do all works queued while it isn't empty, to keep the order.
+ */
+#define WQ_RING_SIZE	4096	/* must be a power of two */
+
+struct work_ring_slot {
+	uint64_t seq;
+	struct work *work;
+};
+
+struct work_ring {
+	uint64_t tail __cacheline_aligned;
+	uint64_t head __cacheline_aligned;
+	struct work_ring_slot slots[WQ_RING_SIZE];
+};
+
+/* returned by deque_steal() when it lost a race, worth a retry */
+#define WQ_STEAL_ABORT	((struct work *)1)
+
+/* works moved at once from the injection queue to a worker's deque */
+#define WQ_GRAB_BATCH	32
+
+/* max works passed to done_batch at once */
+#define WQ_DONE_BATCH	256
+
+/* default weights of WORK_PRIO_WEIGHTED, high to low */
+#define WQ_DEFAULT_WEIGHTS	{ 8, 4, 1 }
+
+/* pending works of one priority level */
+struct wq_lane {
+	struct work_ring *ring;
+	size_t nr_overflow;
+	/* protected by pending_lock */
+	struct list_head overflow;
+
+	uint64_t nr_queued __cacheline_aligned;
+	uint64_t nr_run __cacheline_aligned;
+};
+
+/*
+ * Works queued with a key are serialized on one of WQ_NR_STRANDS strands
+ * chosen by the hash of the key.  A strand with pending works is queued as
+ * a work itself, at most once, and runs up to WQ_STRAND_BATCH of them in
+ * order before giving the other strands a turn.
+ */
+#define WQ_NR_STRANDS	1024	/* must be a power of two */
+#define WQ_STRAND_BATCH	16
+
+struct wq_strand {
+	struct bs_mutex lock;
+	struct list_head pending;
+	bool queued;
+	/* queued to the pool while the strand has pending works */
+	struct work w;
+};
+
+struct wq_info;
+
+/* Statistics of a worker thread, written by the thread only */
+struct wq_thread {
+	struct list_node list;
+	pid_t tid;
+	uint64_t tm_started;
+	uint64_t nr_works;
+	uint64_t busy;
+	struct histogram wait;
+	struct histogram run;
+};
+
+struct wq_worker {
+	struct wq_info *wi;
+	pthread_t thread;
+	unsigned int seed;
+	struct work_deque dq;
+};
+
 struct wq_info {
 	const char *name;
+	int idx;	/* in wq_table */
+
+	struct work_queue_attr attr;
+	/* made from attr, used for all the workers */
+	pthread_attr_t thread_attr;
+
+	/* lock-free stack of finished works, linked by w_list.next */
+	struct list_node *finished;
+	/* used by the main thread only */
+	work_batch_func_t done_batch;
+	struct list_node list;
+
+	struct bs_mutex startup_lock;
+	/* threads not exited yet, protected by startup_lock */
+	size_t nr_alive;
+	struct bs_cond exit_cond;
+	/* set by destroy_work_queue() under pending_lock */
+	bool stopping;
+
+	/* wokers sleep on this and notified by work producer */
+	struct bs_eventcount pending_ec;
+	/* pending works per priority, see struct work_ring */
+	struct wq_lane lanes[WORK_NR_PRIO];
+	/* locked by work producer and workers */
+	struct bs_mutex pending_lock;
+	struct work_queue q;
+
+	/* set under pending_lock, read locklessly by workers */
+	int prio_policy;
+	unsigned int weights[WORK_NR_PRIO];
+	unsigned int weight_sum;
+	/* counts the picks of WORK_PRIO_WEIGHTED */
+	unsigned long prio_tick;
+
+	/* protected by uatomic primitives */
+	size_t nr_queued_work;
+
+	/* protected by pending_lock */
+	size_t nr_threads;
+	size_t min_threads;
+	size_t max_threads;
+	uint64_t tm_end_of_protection;
+
+	/*
+	 * Work stealing mode: a fixed set of workers with a deque each.  The
+	 * pending works are the injection queue for works queued by other
+	 * threads.
+	 */
+	bool stealing;
+	struct wq_worker *workers;
+	size_t nr_workers;
+
+	/* allocated on the first queue_work_keyed() */
+	struct wq_strand *strands;
+
+	/*
+	 * Statistics, see enable_work_queue_stats().  Workers record into
+	 * their wq_thread and the main thread into done_hist, so that nothing
+	 * is shared on the hot paths but max_depth.
+	 */
+	bool stats_enabled;
+	uint64_t tm_stats_enabled;
+	uint64_t tm_stats_disabled;
+	size_t max_depth;
+	uint64_t nr_done;
+	struct histogram done_hist;
+	/* protects threads and the totals of the exited ones */
+	struct bs_mutex stats_lock;
+	struct list_head threads;
+	struct histogram exited_wait;
+	struct histogram exited_run;
+};
+
+/*
+ * Finished works are handed over to the main thread per queue.  A queue
+ * whose finished stack becomes non-empty marks itself in wq_dirty, and only
+ * the first of those marks since the main thread last looked writes efd.
+ */
+#define WQ_MAX_QUEUES	1024
+
+static int efd;
+static bool wq_notified;
+static DECLARE_BITMAP(wq_dirty, WQ_MAX_QUEUES);
+static struct wq_info *wq_table[WQ_MAX_QUEUES];
+/* protects wq_used and wq_info_list */
+static struct bs_mutex wq_table_lock = BS_MUTEX_INITIALIZER;
+static DECLARE_BITMAP(wq_used, WQ_MAX_QUEUES);
+static LIST_HEAD(wq_info_list);
+
+/* the worker of a work stealing queue running on this thread */
+static __thread struct wq_worker *current_worker;
+
+static void *worker_routine(void *arg);
+
+static uint64_t get_msec_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static uint64_t get_nsec_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * NUMA placement goes through the system calls directly rather than
+ * libnuma, so that users of libbs don't need to link it.
+ */
+#define WQ_MAX_NODES	1024
+
+static long wq_mbind(void *addr, size_t len, int node)
+{
+	unsigned long mask[BITS_TO_LONGS(WQ_MAX_NODES)] = { 0 };
+
+	set_bit(node, mask);
+	return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+		       WQ_MAX_NODES + 1, 0);
+}
+
+static long wq_set_mempolicy(int node)
+{
+	unsigned long mask[BITS_TO_LONGS(WQ_MAX_NODES)] = { 0 };
+
+	set_bit(node, mask);
+	return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+		       WQ_MAX_NODES + 1);
+}
+
+/* Allocate zeroed memory from node, or from anywhere if it's negative */
+static void *wq_zalloc_node(size_t size, int node)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	void *p;
+
+	/* the lanes and workers keep hot fields on cache lines of their own */
+	if (node < 0) {
+		if (posix_memalign(&p, CACHELINE_SIZE, size) != 0)
+			panic("Out of memory");
+		memset(p, 0, size);
+		return p;
+	}
+
+	size = (size + page_size - 1) & ~(page_size - 1);
+	if (posix_memalign(&p, page_size, size) != 0)
+		panic("Out of memory");
+	/* before the pages are touched */
+	if (wq_mbind(p, size, node) < 0)
+		bs_warn("failed to bind memory to node %d: %m", node);
+	memset(p, 0, size);
+
+	return p;
+}
+
+/* Read the CPUs of a NUMA node from sysfs, e.g. "0-7,16-23" */
+static int wq_node_cpuset(int node, cpu_set_t *set)
+{
+	char path[PATH_MAX], buf[4096], *p, *end;
+	long first, last;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 node);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = xread(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+
+	CPU_ZERO(set);
+	for (p = buf; *p && *p != '\n'; p = end) {
+		first = strtol(p, &end, 10);
+		if (end == p)
+			return -1;
+		last = first;
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+		if (*end == ',')
+			end++;
+	}
+
+	return 0;
+}
+
+void init_work_queue_attr(struct work_queue_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	CPU_ZERO(&attr->cpuset);
+	attr->numa_node = -1;
+	attr->sched_policy = SCHED_OTHER;
+}
+
+/*
+ * Workers of a queue bound to a NUMA node run on the CPUs of the node which
+ * are in the cpuset, or on all of them if none is.
+ */
+static int wq_init_thread_attr(struct wq_info *wi)
+{
+	struct work_queue_attr *attr = &wi->attr;
+	struct sched_param param = {
+		.sched_priority = attr->sched_priority,
+	};
+	pthread_attr_t *ta = &wi->thread_attr;
+	cpu_set_t cpuset, nodeset;
+	int ret = 0;
+
+	cpuset = attr->cpuset;
+	if (attr->numa_node >= 0) {
+		if (attr->numa_node >= WQ_MAX_NODES ||
+		    wq_node_cpuset(attr->numa_node, &nodeset) < 0) {
+			bs_err("invalid NUMA node %d", attr->numa_node);
+			errno = EINVAL;
+			return -1;
+		}
+		if (!CPU_COUNT(&cpuset))
+			cpuset = nodeset;
+		else if (CPU_COUNT(&nodeset))
+			CPU_AND(&cpuset, &cpuset, &nodeset);
+		if (!CPU_COUNT(&cpuset) && CPU_COUNT(&attr->cpuset)) {
+			bs_err("no CPU of node %d in the cpuset",
+			       attr->numa_node);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	pthread_attr_init(ta);
+	if (CPU_COUNT(&cpuset))
+		ret = pthread_attr_setaffinity_np(ta, sizeof(cpuset), &cpuset);
+	if (!ret && (attr->sched_policy != SCHED_OTHER ||
+		     attr->sched_priority)) {
+		ret = pthread_attr_setinheritsched(ta, PTHREAD_EXPLICIT_SCHED);
+		if (!ret)
+			ret = pthread_attr_setschedpolicy(ta,
+							  attr->sched_policy);
+		if (!ret)
+			ret = pthread_attr_setschedparam(ta, &param);
+	}
+	if (!ret && attr->stack_size)
+		ret = pthread_attr_setstacksize(ta, attr->stack_size);
+	if (ret) {
+		bs_err("invalid work queue attributes: %s", strerror(ret));
+		pthread_attr_destroy(ta);
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Called first by every worker thread */
+static struct wq_thread *wq_worker_start(struct wq_info *wi)
+{
+	struct wq_thread *th;
+
+	bs_mutex_lock(&wi->startup_lock);
+	/* started this thread */
+	bs_mutex_unlock(&wi->startup_lock);
+
+	/* the works run here allocate from the node too */
+	if (wi->attr.numa_node >= 0 &&
+	    wq_set_mempolicy(wi->attr.numa_node) < 0)
+		bs_warn("failed to set memory policy of %s: %m", wi->name);
+
+	th = xcalloc(1, sizeof(*th));
+	th->tid = gettid();
+	th->tm_started = get_nsec_time();
+	bs_mutex_lock(&wi->stats_lock);
+	list_add_tail(&th->list, &wi->threads);
+	bs_mutex_unlock(&wi->stats_lock);
+
+	return th;
+}
+
+/* Called last by a worker thread which leaves the pool */
+static void wq_worker_exit(struct wq_info *wi, struct wq_thread *th)
+{
+	bs_mutex_lock(&wi->stats_lock);
+	list_del(&th->list);
+	hist_merge(&wi->exited_wait, &th->wait);
+	hist_merge(&wi->exited_run, &th->run);
+	bs_mutex_unlock(&wi->stats_lock);
+	free(th);
+
+	bs_mutex_lock(&wi->startup_lock);
+	if (--wi->nr_alive == 0)
+		bs_cond_broadcast(&wi->exit_cond);
+	bs_mutex_unlock(&wi->startup_lock);
+}
+
+/* Lockless check whether wq_need_grow() might be true */
+static inline bool wq_need_grow_hint(struct wq_info *wi)
+{
+	size_t nr_threads = uatomic_read(&wi->nr_threads);
+
+	return nr_threads < uatomic_read(&wi->nr_queued_work) &&
+		nr_threads < uatomic_read(&wi->max_threads);
+}
+
+/*
+ * Grow the pool while the backlog, i.e. works queued but not done yet,
+ * exceeds the number of threads.  Called with pending_lock held.
+ */
+static bool wq_need_grow(struct wq_info *wi)
+{
+	if (uatomic_read(&wi->nr_threads) <
+	    uatomic_read(&wi->nr_queued_work) &&
+	    wi->nr_threads < wi->max_threads) {
+		wi->tm_end_of_protection = get_msec_time() +
+			WQ_PROTECTION_PERIOD;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Return true if more than half of threads are not used more than
+ * WQ_PROTECTION_PERIOD.  Called with pending_lock held.
+ */
+static bool wq_need_shrink(struct wq_info *wi)
+{
+	if (wi->nr_threads <= wi->min_threads)
+		return false;
+
+	if (uatomic_read(&wi->nr_queued_work) < wi->nr_threads / 2)
+		/* we cannot shrink work queue during protection period. */
+		return wi->tm_end_of_protection <= get_msec_time();
+
+	/* update the end of protection time */
+	wi->tm_end_of_protection = get_msec_time() + WQ_PROTECTION_PERIOD;
+	return false;
+}
+
+/* Called with pending_lock held */
+static int create_worker_threads(struct wq_info *wi, size_t nr_threads)
+{
+	pthread_t thread;
+	int ret;
+
+	bs_mutex_lock(&wi->startup_lock);
+	while (wi->nr_threads < nr_threads && !wi->stopping) {
+		ret = pthread_create(&thread, &wi->thread_attr, worker_routine,
+				     wi);
+		if (ret != 0) {
+			bs_err("failed to create worker thread: %s",
+			       strerror(ret));
+			bs_mutex_unlock(&wi->startup_lock);
+			return -1;
+		}
+		pthread_detach(thread);
+		uatomic_inc(&wi->nr_threads);
+		wi->nr_alive++;
+		bs_debug("create thread %s %zu", wi->name, wi->nr_threads);
+	}
+	bs_mutex_unlock(&wi->startup_lock);
+
+	return 0;
+}
+
+static bool deque_push(struct work_deque *dq, struct work *work)
+{
+	int64_t b = uatomic_read(&dq->bottom);
+	int64_t t = smp_load_acquire(&dq->top);
+
+	if (b - t >= WQ_DEQUE_SIZE)
+		return false;
+
+	uatomic_set(&dq->works[b & (WQ_DEQUE_SIZE - 1)], work);
+	uatomic_set(&dq->bottom, b + 1);
+	return true;
+}
+
+static struct work *deque_take(struct work_deque *dq)
+{
+	int64_t b = uatomic_read(&dq->bottom) - 1;
+	int64_t t;
+	struct work *work;
+
+	uatomic_set(&dq->bottom, b);
+	smp_mb();
+	t = uatomic_read(&dq->top);
+	if (t > b) {
+		/* empty */
+		uatomic_set(&dq->bottom, b + 1);
+		return NULL;
+	}
+
+	work = uatomic_read(&dq->works[b & (WQ_DEQUE_SIZE - 1)]);
+	if (t == b) {
+		/* the last one, race against thieves */
+		if (uatomic_cmpxchg(&dq->top, t, t + 1) != t)
+			work = NULL;
+		uatomic_set(&dq->bottom, b + 1);
+	}
+
+	return work;
+}
+
+static struct work *deque_steal(struct work_deque *dq)
+{
+	int64_t t = smp_load_acquire(&dq->top);
+	int64_t b;
+	struct work *work;
+
+	smp_mb();
+	b = smp_load_acquire(&dq->bottom);
+	if (t >= b)
+		return NULL;
+
+	work = uatomic_read(&dq->works[t & (WQ_DEQUE_SIZE - 1)]);
+	if (uatomic_cmpxchg(&dq->top, t, t + 1) != t)
+		return WQ_STEAL_ABORT;
+
+	return work;
+}
+
+static bool deque_empty(struct work_deque *dq)
+{
+	return uatomic_read(&dq->top) >= uatomic_read(&dq->bottom);
+}
+
+/*
+ * Claim as many consecutive free slots as there are works, or as are free,
+ * with a single update of tail.  Returns the number of works pushed.
+ */
+static int ring_push(struct work_ring *ring, struct work **works, int nr)
+{
+	struct work_ring_slot *slot;
+	uint64_t pos, seq;
+	int i;
+
+	pos = uatomic_read(&ring->tail);
+	for (;;) {
+		for (i = 0; i < nr; i++) {
+			slot = &ring->slots[(pos + i) & (WQ_RING_SIZE - 1)];
+			seq = smp_load_acquire(&slot->seq);
+			if (seq != pos + i)
+				break;
+		}
+		if (i > 0) {
+			if (uatomic_cmpxchg(&ring->tail, pos, pos + i) == pos)
+				break;
+		} else if (seq < pos)
+			return 0;
+		pos = uatomic_read(&ring->tail);
+	}
+
+	nr = i;
+	for (i = 0; i < nr; i++) {
+		slot = &ring->slots[(pos + i) & (WQ_RING_SIZE - 1)];
+		slot->work = works[i];
+		smp_store_release(&slot->seq, pos + i + 1);
+	}
+	return nr;
+}
+
+static struct work *ring_pop(struct work_ring *ring)
+{
+	struct work_ring_slot *slot;
+	struct work *work;
+	uint64_t pos, seq;
+
+	pos = uatomic_read(&ring->head);
+	for (;;) {
+		slot = &ring->slots[pos & (WQ_RING_SIZE - 1)];
+		seq = smp_load_acquire(&slot->seq);
+		if (seq == pos + 1) {
+			if (uatomic_cmpxchg(&ring->head, pos, pos + 1) == pos)
+				break;
+		} else if (seq < pos + 1)
+			return NULL;
+		pos = uatomic_read(&ring->head);
+	}
+
+	work = slot->work;
+	/* hand the slot over to the producers of the next lap */
+	smp_store_release(&slot->seq, pos + WQ_RING_SIZE);
+	return work;
+}
+
+static bool ring_empty(struct work_ring *ring)
+{
+	uint64_t pos = uatomic_read(&ring->head);
+	struct work_ring_slot *slot = &ring->slots[pos & (WQ_RING_SIZE - 1)];
+
+	return smp_load_acquire(&slot->seq) != pos + 1;
+}
+
+/* Tags the work of a strand, never called */
+static void wq_strand_fn(struct work *work)
+{
+}
+
+/*
+ * A strand goes through the lanes once per batch of its works, so the lane
+ * counters skip it and count its works instead, see queue_work_keyed().
+ * Strands are always submitted alone.
+ */
+static inline bool wq_is_strand(struct work *work)
+{
+	return work->fn == wq_strand_fn;
+}
+
+static void wq_push_pending(struct wq_info *wi, enum work_prio prio,
+			    struct work **works, int nr)
+{
+	struct wq_lane *lane = &wi->lanes[prio];
+	int i, ret;
+
+	if (likely(nr != 1 || !wq_is_strand(works[0])))
+		uatomic_add(&lane->nr_queued, nr);
+	while (nr > 0 && likely(!uatomic_read(&lane->nr_overflow))) {
+		ret = ring_push(lane->ring, works, nr);
+		if (!ret)
+			break;
+		works += ret;
+		nr -= ret;
+	}
+	if (likely(nr == 0))
+		return;
+
+	bs_mutex_lock(&wi->pending_lock);
+	for (i = 0; i < nr; i++)
+		list_add_tail(&works[i]->w_list, &lane->overflow);
+	uatomic_add(&lane->nr_overflow, nr);
+	bs_mutex_unlock(&wi->pending_lock);
+}
+
+static struct work *wq_pop_lane(struct wq_info *wi, enum work_prio prio)
+{
+	struct wq_lane *lane = &wi->lanes[prio];
+	struct work *work;
+
+	work = ring_pop(lane->ring);
+	if (work)
+		goto out;
+	if (likely(!uatomic_read(&lane->nr_overflow)))
+		return NULL;
+
+	bs_mutex_lock(&wi->pending_lock);
+	if (!list_empty(&lane->overflow)) {
+		work = list_first_entry(&lane->overflow, struct work, w_list);
+		list_del(&work->w_list);
+		uatomic_dec(&lane->nr_overflow);
+	}
+	bs_mutex_unlock(&wi->pending_lock);
+	if (!work)
+		return NULL;
+out:
+	if (likely(!wq_is_strand(work)))
+		uatomic_inc(&lane->nr_run);
+	return work;
+}
+
+/*
+ * WORK_PRIO_WEIGHTED starts from the level owning the current tick, so that
+ * under backlog each level is served in proportion to its weight.  Empty
+ * levels give their turn to the others.
+ */
+static enum work_prio wq_pick_lane(struct wq_info *wi)
+{
+	unsigned long tick;
+	unsigned int sum;
+	int prio;
+
+	sum = uatomic_read(&wi->weight_sum);
+	if (!sum)
+		return WORK_PRIO_HIGH;
+
+	tick = uatomic_add_return(&wi->prio_tick, 1) % sum;
+	for (prio = 0; prio < WORK_NR_PRIO; prio++) {
+		sum = uatomic_read(&wi->weights[prio]);
+		if (tick < sum)
+			return prio;
+		tick -= sum;
+	}
+
+	/* raced with set_work_queue_prio_policy() */
+	return WORK_PRIO_HIGH;
+}
+
+static struct work *wq_pop_pending(struct wq_info *wi)
+{
+	struct work *work;
+	int prio, tried = -1;
+
+	if (uatomic_read(&wi->prio_policy) == WORK_PRIO_WEIGHTED) {
+		tried = wq_pick_lane(wi);
+		work = wq_pop_lane(wi, tried);
+		if (work)
+			return work;
+	}
+
+	/* strict order, also the fallback of an empty weighted pick */
+	for (prio = 0; prio < WORK_NR_PRIO; prio++) {
+		if (prio == tried)
+			continue;
+		work = wq_pop_lane(wi, prio);
+		if (work)
+			return work;
+	}
+
+	return NULL;
+}
+
+static bool wq_lane_empty(struct wq_info *wi, enum work_prio prio)
+{
+	struct wq_lane *lane = &wi->lanes[prio];
+
+	return ring_empty(lane->ring) && !uatomic_read(&lane->nr_overflow);
+}
+
+static bool wq_has_pending(struct wq_info *wi)
+{
+	int prio;
+
+	for (prio = 0; prio < WORK_NR_PRIO; prio++)
+		if (!wq_lane_empty(wi, prio))
+			return true;
+
+	return false;
+}
+
+/*
+ * Normal priority works queued by a worker of the queue itself go to its own
+ * deque, all the others to the injection queue.
+ */
+static void queue_stealing_work(struct wq_info *wi, enum work_prio prio,
+				struct work **works, int nr)
+{
+	struct wq_worker *me = current_worker;
+	int i = 0;
+
+	if (me && me->wi == wi && prio == WORK_PRIO_NORMAL)
+		while (i < nr && deque_push(&me->dq, works[i]))
+			i++;
+	wq_push_pending(wi, prio, works + i, nr - i);
+
+	bs_ec_notify(&wi->pending_ec, nr);
+}
+
+static void wq_stats_queued(struct wq_info *wi, struct work **works, int nr,
+			    size_t depth)
+{
+	uint64_t now = 0;
+	size_t max;
+	int i;
+
+	if (unlikely(uatomic_read(&wi->stats_enabled))) {
+		now = get_nsec_time();
+		max = uatomic_read(&wi->max_depth);
+		while (depth > max)
+			max = uatomic_cmpxchg(&wi->max_depth, max, depth);
+	}
+
+	/* a work queued while disabled is not timed */
+	for (i = 0; i < nr; i++)
+		works[i]->tm_queued = now;
+}
+
+/* Hand works over to the workers; they are counted by the caller */
+static void wq_submit(struct wq_info *wi, enum work_prio prio,
+		      struct work **works, int nr)
+{
+	if (wi->stealing) {
+		queue_stealing_work(wi, prio, works, nr);
+		return;
+	}
+
+	if (unlikely(wq_need_grow_hint(wi))) {
+		bs_mutex_lock(&wi->pending_lock);
+		if (wq_need_grow(wi))
+			/* double the thread pool size */
+			create_worker_threads(wi, min(wi->nr_threads * 2,
+						      wi->max_threads));
+		bs_mutex_unlock(&wi->pending_lock);
+	}
+
+	wq_push_pending(wi, prio, works, nr);
+	bs_ec_notify(&wi->pending_ec, nr);
+}
+
+static void wq_queue_works(struct wq_info *wi, enum work_prio prio,
+			   struct work **works, int nr)
+{
+	size_t depth;
+
+	depth = uatomic_add_return(&wi->nr_queued_work, nr);
+	/* before the works are visible to the workers */
+	wq_stats_queued(wi, works, nr, depth);
+	wq_submit(wi, prio, works, nr);
+}
+
+/*
+ * Queue nr works at once.  Producers and workers pay for the pending queue
+ * update and the wakeup once per batch rather than once per work.
+ */
+void queue_work_batch(struct work_queue *q, struct work **works, int nr)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+
+	if (nr <= 0)
+		return;
+
+	wq_queue_works(wi, WORK_PRIO_NORMAL, works, nr);
+}
+
+void queue_work(struct work_queue *q, struct work *work)
+{
+	queue_work_batch(q, &work, 1);
+}
+
+/*
+ * Queue a work at the given priority level.  The levels are served as set by
+ * set_work_queue_prio_policy(), strictly from high to low by default.
+ */
+void queue_work_prio(struct work_queue *q, struct work *work,
+		     enum work_prio prio)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+
+	assert(prio >= 0 && prio < WORK_NR_PRIO);
+	wq_queue_works(wi, prio, &work, 1);
+}
+
+static struct wq_strand *wq_get_strands(struct wq_info *wi)
+{
+	struct wq_strand *strands, *old;
+	int i;
+
+	strands = smp_load_acquire(&wi->strands);
+	if (likely(strands))
+		return strands;
+
+	strands = xcalloc(WQ_NR_STRANDS, sizeof(*strands));
+	for (i = 0; i < WQ_NR_STRANDS; i++) {
+		bs_init_mutex(&strands[i].lock);
+		INIT_LIST_HEAD(&strands[i].pending);
+		strands[i].w.fn = wq_strand_fn;
+	}
+
+	old = uatomic_cmpxchg(&wi->strands, NULL, strands);
+	if (old) {
+		/* lost the race */
+		for (i = 0; i < WQ_NR_STRANDS; i++)
+			bs_destroy_mutex(&strands[i].lock);
+		free(strands);
+		return old;
+	}
+
+	return strands;
+}
+
+static inline unsigned int wq_hash_key(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return key & (WQ_NR_STRANDS - 1);
+}
+
+/*
+ * Queue a work which runs after all the works queued with the same key
+ * before it, and whose done() is called after theirs too.  Works with
+ * different keys run in parallel, though a few keys share a strand and
+ * are serialized against each other.
+ */
+void queue_work_keyed(struct work_queue *q, struct work *work, uint64_t key)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+	struct wq_strand *strand;
+	struct work *sw = NULL;
+	size_t depth;
+
+	strand = &wq_get_strands(wi)[wq_hash_key(key)];
+
+	depth = uatomic_add_return(&wi->nr_queued_work, 1);
+	wq_stats_queued(wi, &work, 1, depth);
+	uatomic_inc(&wi->lanes[WORK_PRIO_NORMAL].nr_queued);
+
+	bs_mutex_lock(&strand->lock);
+	list_add_tail(&work->w_list, &strand->pending);
+	if (!strand->queued) {
+		strand->queued = true;
+		sw = &strand->w;
+	}
+	bs_mutex_unlock(&strand->lock);
+
+	if (sw)
+		wq_submit(wi, WORK_PRIO_NORMAL, &sw, 1);
+}
+
+/* Queue a work ahead of all the normal and low priority ones */
+void queue_work_first_entry(struct work_queue *q, struct work *work)
+{
+	queue_work_prio(q, work, WORK_PRIO_HIGH);
+}
+
+/*
+ * WORK_PRIO_STRICT always serves the highest non-empty level, which may
+ * starve the lower ones.  WORK_PRIO_WEIGHTED serves each level in
+ * proportion to weights[prio] while they are all backlogged; NULL weights
+ * mean WQ_DEFAULT_WEIGHTS.
+ */
+int set_work_queue_prio_policy(struct work_queue *q,
+			       enum work_prio_policy policy,
+			       const unsigned int *weights)
+{
+	static const unsigned int default_weights[] = WQ_DEFAULT_WEIGHTS;
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+	unsigned int sum = 0;
+	int prio;
+
+	if (policy != WORK_PRIO_STRICT && policy != WORK_PRIO_WEIGHTED) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!weights)
+		weights = default_weights;
+	for (prio = 0; prio < WORK_NR_PRIO; prio++)
+		sum += weights[prio];
+	if (!sum) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bs_mutex_lock(&wi->pending_lock);
+	for (prio = 0; prio < WORK_NR_PRIO; prio++)
+		uatomic_set(&wi->weights[prio], weights[prio]);
+	uatomic_set(&wi->weight_sum, sum);
+	uatomic_set(&wi->prio_policy, policy);
+	bs_mutex_unlock(&wi->pending_lock);
+
+	return 0;
+}
+
+/*
+ * Works a stealing worker queues to its own deque don't go through the
+ * levels and are not counted here.
+ */
+int get_work_queue_prio_stats(struct work_queue *q, enum work_prio prio,
+			      struct work_prio_stats *stats)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+	struct wq_lane *lane;
+
+	if (prio < 0 || prio >= WORK_NR_PRIO) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	lane = &wi->lanes[prio];
+	stats->nr_run = uatomic_read(&lane->nr_run);
+	stats->nr_queued = uatomic_read(&lane->nr_queued);
+	/* a work is counted as queued before it can be run */
+	stats->nr_pending = stats->nr_queued - stats->nr_run;
+
+	return 0;
+}
+
+/*
+ * Let done_batch be called with the finished works of q, up to
+ * WQ_DONE_BATCH at a time in the order they finished, instead of calling
+ * their done() one by one.  NULL restores the latter.  Must be called from
+ * the main thread.
+ */
+void set_work_queue_done_batch(struct work_queue *q,
+			       work_batch_func_t done_batch)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+
+	wi->done_batch = done_batch;
+}
+
+/*
+ * Let the pool of q grow up to max_threads under backlog and shrink down to
+ * min_threads after WQ_PROTECTION_PERIOD of low load.  The pool is grown to
+ * min_threads at once.
+ */
+int set_work_queue_threads(struct work_queue *q, size_t min_threads,
+			   size_t max_threads)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+	int ret;
+
+	if (wi->stealing || min_threads == 0 || min_threads > max_threads) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	struct list_head finished_list;
-	struct list_node list;
+	bs_mutex_lock(&wi->pending_lock);
+	wi->min_threads = min_threads;
+	uatomic_set(&wi->max_threads, max_threads);
+	ret = create_worker_threads(wi, min_threads);
+	bs_mutex_unlock(&wi->pending_lock);
 
-	struct bs_mutex finished_lock;
-	struct bs_mutex startup_lock;
+	return ret;
+}
 
-	/* wokers sleep on this and signaled by work producer */
-	struct bs_cond pending_cond;
-	/* locked by work producer and workers */
-	struct bs_mutex pending_lock;
-	/* protected by pending_lock */
-	struct work_queue q;
+/* Called by the main thread before calling done() of nr works */
+static void wq_stats_done(struct wq_info *wi, struct work **works, int nr)
+{
+	uint64_t now;
+	int i;
 
-	/* protected by uatomic primitives */
-	size_t nr_queued_work;
+	if (likely(!uatomic_read(&wi->stats_enabled)))
+		return;
 
-	uint64_t tm_end_of_protection;
-};
+	now = get_nsec_time();
+	for (i = 0; i < nr; i++)
+		if (works[i]->tm_finished)
+			hist_record(&wi->done_hist,
+				    now - works[i]->tm_finished);
+	uatomic_add(&wi->nr_done, nr);
+}
 
-static int efd;
-static LIST_HEAD(wq_info_list);
+/* Call done() of the finished works of wi in the order they finished */
+static void wq_run_done(struct wq_info *wi)
+{
+	struct list_node *node, *next, *prev = NULL;
+	struct work *vec[WQ_DONE_BATCH];
+	struct work *work;
+	int nr = 0;
 
-static void *worker_routine(void *arg);
+	node = uatomic_xchg(&wi->finished, NULL);
+	while (node) {
+		next = node->next;
+		node->next = prev;
+		prev = node;
+		node = next;
+	}
 
-static uint64_t get_msec_time(void)
-{
-	struct timeval tv;
+	for (node = prev; node; node = next) {
+		next = node->next;
+		work = container_of(node, struct work, w_list);
 
-	gettimeofday(&tv, NULL);
-	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+		if (!wi->done_batch) {
+			wq_stats_done(wi, &work, 1);
+			work->done(work);
+			uatomic_dec(&wi->nr_queued_work);
+			continue;
+		}
+
+		vec[nr++] = work;
+		if (nr == WQ_DONE_BATCH || !next) {
+			wq_stats_done(wi, vec, nr);
+			wi->done_batch(vec, nr);
+			uatomic_sub(&wi->nr_queued_work, nr);
+			nr = 0;
+		}
+	}
 }
 
-static bool wq_destroy(struct wq_info *wi)
+static void worker_thread_request_done(int fd, int events, void *data)
 {
+	struct wq_info *wi;
+	unsigned long bits;
+	int i, bit;
+
+	eventfd_xread(fd);
+	/* marks from now on notify again */
+	uatomic_set(&wq_notified, false);
 
+	for (i = 0; i < BITS_TO_LONGS(WQ_MAX_QUEUES); i++) {
+		if (!uatomic_read(&wq_dirty[i]))
+			continue;
+		bits = uatomic_xchg(&wq_dirty[i], 0);
+		while (bits) {
+			bit = __builtin_ctzl(bits);
+			bits &= bits - 1;
+			wi = uatomic_read(&wq_table[i * BITS_PER_LONG + bit]);
+			/* destroyed by a done() called above */
+			if (wi)
+				wq_run_done(wi);
+		}
+	}
 }
 
-static int create_worker_threads(struct wq_info *wi)
+/* Hand a work over to the main thread, which calls its done() */
+static void wq_work_finished(struct wq_info *wi, struct work *work)
 {
-	pthread_t thread;
-	int ret;
+	struct list_node *head, *old;
 
-	mutex_lock(&wi->startup_lock);
-	ret = pthread_create(&thread, NULL, worker_routine, wi);
-	if (ret != 0) {
-		sd_err("failed to create worket therad: %m");
-		mutex_unlock(&wi->startup_lock);
-		return -1;
+	head = uatomic_read(&wi->finished);
+	for (;;) {
+		work->w_list.next = head;
+		old = uatomic_cmpxchg(&wi->finished, head, &work->w_list);
+		if (old == head)
+			break;
+		head = old;
 	}
-	sd_debug("create thread %s", wi->name);
-	mutex_unlock(&wi->startup_lock);
 
-	return 0;
+	/* the queue is marked already unless the stack was empty */
+	if (head)
+		return;
+
+	atomic_set_bit(wi->idx, wq_dirty);
+	/* notify event to worker_thread_request_done */
+	if (!uatomic_xchg(&wq_notified, true))
+		eventfd_xwrite(efd, 1);
 }
 
-void queue_work(struct work_queue *q, struct work *work)
+/* Run fn() of a work on a worker thread and hand it over to done() */
+static void wq_call_work(struct wq_info *wi, struct wq_thread *th,
+			 struct work *work)
 {
-	struct wq_info *wi = container_of(q, struct wq_info, q);
+	uint64_t start, end;
 
-	uatomic_inc(&wi->nr_queued_work);
-	bs_mutex_lock(&wi->pending_lock);
+	if (likely(!uatomic_read(&wi->stats_enabled))) {
+		if (work->fn)
+			work->fn(work);
+		work->tm_finished = 0;
+		wq_work_finished(wi, work);
+		return;
+	}
 
-	list_add_tail(&work->w_list, &wi->q.pending_list);
-	bs_mutex_unlock(&wi->pending_lock);
+	start = get_nsec_time();
+	if (work->tm_queued)
+		hist_record(&th->wait, start - work->tm_queued);
+	if (work->fn)
+		work->fn(work);
+	end = get_nsec_time();
+	hist_record(&th->run, end - start);
+	th->busy += end - start;
+	th->nr_works++;
 
-	bs_cond_signal(&wi->pending_cond);
+	work->tm_finished = end;
+	wq_work_finished(wi, work);
 }
 
-static void worker_thread_request_done(int fd, int events, void *data)
+static void wq_run_strand(struct wq_info *wi, struct wq_thread *th,
+			  struct wq_strand *strand)
 {
-	struct wq_info *wi;
-	struct work *work;
-	LIST_HEAD(list);
+	struct work *work, *sw = &strand->w;
+	int i;
 
-	eventfd_xread(fd);
+	for (i = 0; i < WQ_STRAND_BATCH; i++) {
+		/* the rest is cancelled */
+		if (unlikely(uatomic_read(&wi->stopping)))
+			return;
 
-	list_for_each_entry(wi, &wq_info_list, list) {
-		bs_mutex_lock(&wi->finished_lock);
-		list_splice_init(&wi->finished_list, &list);
-		bs_mutex_unlock(&wi->finished_lock);
+		bs_mutex_lock(&strand->lock);
+		if (list_empty(&strand->pending)) {
+			strand->queued = false;
+			bs_mutex_unlock(&strand->lock);
+			return;
+		}
+		work = list_first_entry(&strand->pending, struct work, w_list);
+		list_del(&work->w_list);
+		bs_mutex_unlock(&strand->lock);
 
-		while(!list_empty(&list)) {
-			work = list_first_entry(&list, struct work, w_list);
-			list_del(&work->w_list);
+		uatomic_inc(&wi->lanes[WORK_PRIO_NORMAL].nr_run);
+		wq_call_work(wi, th, work);
+	}
 
-			work->done(work);
+	/* still queued, go to the back of the pool */
+	wq_submit(wi, WORK_PRIO_NORMAL, &sw, 1);
+}
 
-			uatomic_dec(&wi->nr_queued_work);
-		}
+static void wq_run_work(struct wq_info *wi, struct wq_thread *th,
+			struct work *work)
+{
+	if (unlikely(wq_is_strand(work)))
+		wq_run_strand(wi, th, container_of(work, struct wq_strand, w));
+	else
+		wq_call_work(wi, th, work);
+}
+
+/*
+ * Called by a worker which found nothing to do.  Returns true if the worker
+ * should exit to shrink the pool, otherwise sleeps until works are queued,
+ * or for WQ_PROTECTION_PERIOD so that idle pools shrink as well.
+ */
+static bool wq_idle(struct wq_info *wi)
+{
+	uint32_t key;
+	bool shrink;
+
+	key = bs_ec_prepare_wait(&wi->pending_ec);
+	if (wq_has_pending(wi) || uatomic_read(&wi->stopping)) {
+		bs_ec_cancel_wait(&wi->pending_ec);
+		return false;
+	}
+
+	bs_mutex_lock(&wi->pending_lock);
+	shrink = wq_need_shrink(wi);
+	if (shrink)
+		uatomic_dec(&wi->nr_threads);
+	bs_mutex_unlock(&wi->pending_lock);
+	if (shrink) {
+		bs_ec_cancel_wait(&wi->pending_ec);
+		return true;
 	}
+
+	bs_ec_wait(&wi->pending_ec, key, WQ_PROTECTION_PERIOD);
+	return false;
 }
 
 static void *worker_routine(void *arg)
 {
 	struct wq_info *wi = arg;
+	struct wq_thread *th;
 	struct work *work;
 
-	bs_mutex_lock(&wi->startup_lock);
-	/* started this thread */
-	bs_mutex_unlock(&wi->startup_lock);
-
-	while (true) {
+	th = wq_worker_start(wi);
 
-		bs_mutex_lock(&wi->pending_lock);
-		if (list_empty(&wi->q.pending_list)) {
-			bs_cond_wait(&wi->pending_cond, &wi->pending_lock);
+	while (!uatomic_read(&wi->stopping)) {
+		work = wq_pop_pending(wi);
+		if (!work) {
+			if (wq_idle(wi)) {
+				bs_debug("destroy thread %s %d, %zu", wi->name,
+					 gettid(), wi->nr_threads);
+				break;
+			}
 			continue;
 		}
 
-		work = list_first_entry(&wi->q.pending_list,
-				struct work, w_list);
+		wq_run_work(wi, th, work);
+	}
 
-		list_del(&work->w_list);
-		bs_mutex_unlock(&wi->pending_lock);
+	wq_worker_exit(wi, th);
+	pthread_exit(NULL);
+}
 
-		if (work->fn)
-			work->fn(work);
+/*
+ * Move a batch of works from the injection queue to the deque of me and
+ * return the first one.
+ */
+static struct work *wq_grab_pending(struct wq_worker *me)
+{
+	struct wq_info *wi = me->wi;
+	struct work *work, *first;
+	int i;
 
-		bs_mutex_lock(&wi->finished_lock);
-		list_add_tail(&work->w_list, &wi->finished_list);
-		bs_mutex_unlock(&wi->finished_lock);
-	
-		/* notify event to worker_thread_request_done */
-		eventfd_xwrite(efd, 1);
+	first = wq_pop_pending(wi);
+	if (!first)
+		return NULL;
+
+	/* the deque is empty, so there is room for the batch */
+	for (i = 1; i < WQ_GRAB_BATCH; i++) {
+		work = wq_pop_pending(wi);
+		if (!work)
+			break;
+		deque_push(&me->dq, work);
+	}
+
+	/* let the others steal the rest */
+	if (i > 1)
+		bs_ec_notify(&wi->pending_ec, 1);
+
+	return first;
+}
+
+static struct work *wq_steal_work(struct wq_worker *me)
+{
+	struct wq_info *wi = me->wi;
+	struct work *work;
+	size_t i, start;
+
+	start = rand_r(&me->seed) % wi->nr_workers;
+	for (i = 0; i < wi->nr_workers; i++) {
+		struct wq_worker *victim;
+
+		victim = &wi->workers[(start + i) % wi->nr_workers];
+		if (victim == me)
+			continue;
+		do {
+			work = deque_steal(&victim->dq);
+		} while (work == WQ_STEAL_ABORT);
+		if (work)
+			return work;
+	}
+
+	return NULL;
+}
+
+static bool wq_has_work(struct wq_info *wi)
+{
+	size_t i;
+
+	if (wq_has_pending(wi))
+		return true;
+	for (i = 0; i < wi->nr_workers; i++)
+		if (!deque_empty(&wi->workers[i].dq))
+			return true;
+
+	return false;
+}
+
+/* Sleep until some work shows up in the queue */
+static void wq_park(struct wq_info *wi)
+{
+	uint32_t key;
+
+	key = bs_ec_prepare_wait(&wi->pending_ec);
+	if (wq_has_work(wi) || uatomic_read(&wi->stopping)) {
+		bs_ec_cancel_wait(&wi->pending_ec);
+		return;
+	}
+	bs_ec_wait(&wi->pending_ec, key, -1);
+}
+
+static void *stealing_worker_routine(void *arg)
+{
+	struct wq_worker *me = arg;
+	struct wq_info *wi = me->wi;
+	struct wq_thread *th;
+	struct work *work;
+
+	current_worker = me;
+
+	th = wq_worker_start(wi);
+
+	while (!uatomic_read(&wi->stopping)) {
+		/* high priority works go ahead of the deques */
+		work = wq_pop_lane(wi, WORK_PRIO_HIGH);
+		if (!work)
+			work = deque_take(&me->dq);
+		if (!work)
+			work = wq_grab_pending(me);
+		if (!work)
+			work = wq_steal_work(me);
+		if (!work) {
+			wq_park(wi);
+			continue;
+		}
+
+		wq_run_work(wi, th, work);
 	}
 
+	wq_worker_exit(wi, th);
 	pthread_exit(NULL);
 }
 
@@ -193,43 +1412,414 @@ int init_work_queue(void)
 	return 0;
 }
 
-struct work_queue *create_work_queue(const char *name)
+/* Make all the workers of wi exit and wait for them */
+static void wq_stop_workers(struct wq_info *wi)
 {
-	int ret;
+	/* no more threads are created from now on */
+	bs_mutex_lock(&wi->pending_lock);
+	uatomic_set(&wi->stopping, true);
+	bs_mutex_unlock(&wi->pending_lock);
+	bs_ec_notify(&wi->pending_ec, INT_MAX);
+
+	bs_mutex_lock(&wi->startup_lock);
+	while (wi->nr_alive)
+		bs_cond_wait(&wi->exit_cond, &wi->startup_lock);
+	bs_mutex_unlock(&wi->startup_lock);
+}
+
+static struct wq_info *alloc_wq_info(const char *name,
+				     const struct work_queue_attr *attr)
+{
+	static const unsigned int default_weights[] = WQ_DEFAULT_WEIGHTS;
 	struct wq_info *wi;
+	struct wq_lane *lane;
+	uint64_t i;
+	int idx, prio;
 
-	wi = xcalloc(1, sizeof(*wi));
+	wi = wq_zalloc_node(sizeof(*wi), -1);
 	wi->name = name;
+	if (attr)
+		wi->attr = *attr;
+	else
+		init_work_queue_attr(&wi->attr);
+	if (wq_init_thread_attr(wi) < 0) {
+		free(wi);
+		return NULL;
+	}
+
+	bs_mutex_lock(&wq_table_lock);
+	idx = find_next_zero_bit(wq_used, WQ_MAX_QUEUES, 0);
+	if (idx == WQ_MAX_QUEUES) {
+		bs_mutex_unlock(&wq_table_lock);
+		bs_err("too many work queues");
+		pthread_attr_destroy(&wi->thread_attr);
+		free(wi);
+		return NULL;
+	}
+	set_bit(idx, wq_used);
+	bs_mutex_unlock(&wq_table_lock);
+	wi->idx = idx;
 
-	INIT_LIST_HEAD(&wi->q.pending_list);
-	INIT_LIST_HEAD(&wi->finished_list);
+	for (prio = 0; prio < WORK_NR_PRIO; prio++) {
+		lane = &wi->lanes[prio];
+		lane->ring = wq_zalloc_node(sizeof(*lane->ring),
+					    wi->attr.numa_node);
+		for (i = 0; i < WQ_RING_SIZE; i++)
+			lane->ring->slots[i].seq = i;
+		INIT_LIST_HEAD(&lane->overflow);
 
-	bs_init_cond(&wi->pending_cond);
+		wi->weights[prio] = default_weights[prio];
+		wi->weight_sum += default_weights[prio];
+	}
+	wi->prio_policy = WORK_PRIO_STRICT;
 
 	bs_init_mutex(&wi->pending_lock);
-	bs_init_mutex(&wi->finished_lock);
+	bs_init_mutex(&wi->startup_lock);
+	bs_init_mutex(&wi->stats_lock);
+	bs_cond_init(&wi->exit_cond);
+	INIT_LIST_HEAD(&wi->threads);
+
+	/* before any worker can finish a work */
+	uatomic_set(&wq_table[idx], wi);
+
+	return wi;
+}
 
-	ret = create_worker_threads(wi);
+static void free_wq_info(struct wq_info *wi)
+{
+	int prio, i;
+
+	bs_mutex_lock(&wq_table_lock);
+	uatomic_set(&wq_table[wi->idx], NULL);
+	clear_bit(wi->idx, wq_used);
+	bs_mutex_unlock(&wq_table_lock);
+
+	bs_destroy_mutex(&wi->pending_lock);
+	bs_destroy_mutex(&wi->startup_lock);
+	bs_destroy_mutex(&wi->stats_lock);
+	bs_destroy_cond(&wi->exit_cond);
+	pthread_attr_destroy(&wi->thread_attr);
+	for (prio = 0; prio < WORK_NR_PRIO; prio++)
+		free(wi->lanes[prio].ring);
+	if (wi->strands) {
+		for (i = 0; i < WQ_NR_STRANDS; i++)
+			bs_destroy_mutex(&wi->strands[i].lock);
+		free(wi->strands);
+	}
+	free(wi->workers);
+	free(wi);
+}
+
+/*
+ * Create a work queue with a single worker, whose pool can be made to grow
+ * and shrink with the backlog by set_work_queue_threads().  attr may be
+ * NULL for the defaults.
+ */
+struct work_queue *create_work_queue(const char *name,
+				     const struct work_queue_attr *attr)
+{
+	int ret;
+	struct wq_info *wi;
+
+	wi = alloc_wq_info(name, attr);
+	if (!wi)
+		return NULL;
+	wi->min_threads = WQ_DEFAULT_MIN_THREADS;
+	wi->max_threads = WQ_DEFAULT_MAX_THREADS;
+
+	bs_mutex_lock(&wi->pending_lock);
+	ret = create_worker_threads(wi, wi->min_threads);
+	bs_mutex_unlock(&wi->pending_lock);
 	if (ret < 0)
 		goto destroy_threads;
 
+	bs_mutex_lock(&wq_table_lock);
 	list_add(&wi->list, &wq_info_list);
+	bs_mutex_unlock(&wq_table_lock);
 
 	return &wi->q;
 
 destroy_threads:
-	bs_mutex_unlock(&wi->startup_lock);
-	destroy_cond(&wi->pending_cond);
-	destroy_mutex(&wi->pending_lock);
-	destroy_mutex(&wi->finished_lock);
-	free(wi);
+	wq_stop_workers(wi);
+	free_wq_info(wi);
 
 	return NULL;
 }
 
+/*
+ * Create a work queue served by a fixed set of nr_threads workers, one per
+ * online CPU if 0, which balance the load by stealing works from each
+ * other.  Works queued from the workers of the queue itself don't go
+ * through any lock.
+ */
+struct work_queue *create_stealing_work_queue(const char *name,
+					      size_t nr_threads,
+					      const struct work_queue_attr *attr)
+{
+	struct wq_worker *worker;
+	struct wq_info *wi;
+	size_t i;
+	int ret;
+
+	if (!nr_threads)
+		nr_threads = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+
+	wi = alloc_wq_info(name, attr);
+	if (!wi)
+		return NULL;
+	wi->stealing = true;
+	wi->workers = wq_zalloc_node(nr_threads * sizeof(*wi->workers),
+				     wi->attr.numa_node);
+	wi->nr_workers = nr_threads;
+
+	/* all the deques exist before any worker starts stealing */
+	for (i = 0; i < nr_threads; i++) {
+		wi->workers[i].wi = wi;
+		wi->workers[i].seed = i;
+	}
+
+	bs_mutex_lock(&wi->startup_lock);
+	for (i = 0; i < nr_threads; i++) {
+		worker = &wi->workers[i];
+		ret = pthread_create(&worker->thread, &wi->thread_attr,
+				     stealing_worker_routine, worker);
+		if (ret != 0) {
+			/* e.g. no permission for the scheduling policy */
+			bs_err("failed to create worker thread: %s",
+			       strerror(ret));
+			bs_mutex_unlock(&wi->startup_lock);
+			wq_stop_workers(wi);
+			free_wq_info(wi);
+			errno = ret;
+			return NULL;
+		}
+		pthread_detach(worker->thread);
+		wi->nr_threads++;
+		wi->nr_alive++;
+	}
+	bs_mutex_unlock(&wi->startup_lock);
+	bs_debug("create %zu stealing threads %s", nr_threads, name);
+
+	bs_mutex_lock(&wq_table_lock);
+	list_add(&wi->list, &wq_info_list);
+	bs_mutex_unlock(&wq_table_lock);
+
+	return &wi->q;
+}
+
+/* Call done() of the works of wi on this thread until none is left */
+static void wq_drain(struct wq_info *wi)
+{
+	struct pollfd pfd = { .fd = efd, .events = POLLIN };
+
+	for (;;) {
+		/* the main loop may have taken the mark of wi already */
+		wq_run_done(wi);
+		if (!uatomic_read(&wi->nr_queued_work))
+			break;
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			panic("failed to poll event fd, %m");
+		worker_thread_request_done(efd, pfd.revents, NULL);
+	}
+}
+
+static int wq_cancel_work(struct work *work, struct list_head *cancelled)
+{
+	/* a strand holds its works itself */
+	if (wq_is_strand(work))
+		return 0;
+
+	list_add_tail(&work->w_list, cancelled);
+	return 1;
+}
+
+/* Move the works which never started to cancelled, once no worker is left */
+static int wq_cancel_pending(struct wq_info *wi, struct list_head *cancelled)
+{
+	struct wq_strand *strand;
+	struct work *work;
+	int prio, nr = 0;
+	size_t i;
+
+	for (prio = 0; prio < WORK_NR_PRIO; prio++)
+		while ((work = wq_pop_lane(wi, prio)))
+			nr += wq_cancel_work(work, cancelled);
+
+	for (i = 0; i < wi->nr_workers; i++)
+		while ((work = deque_steal(&wi->workers[i].dq)))
+			nr += wq_cancel_work(work, cancelled);
+
+	for (i = 0; wi->strands && i < WQ_NR_STRANDS; i++) {
+		strand = &wi->strands[i];
+		while (!list_empty(&strand->pending)) {
+			work = list_first_entry(&strand->pending, struct work,
+						w_list);
+			list_del(&work->w_list);
+			nr += wq_cancel_work(work, cancelled);
+		}
+	}
+
+	uatomic_sub(&wi->nr_queued_work, nr);
+	return nr;
+}
+
+/*
+ * Stop q, wait for its workers to exit and free it.
+ *
+ * WORK_QUEUE_DRAIN runs the works queued so far, and those they queue in
+ * turn, to completion first.  WORK_QUEUE_CANCEL waits only for the works
+ * already running and moves the others to cancelled, linked by w_list,
+ * without calling their done().  Returns the number of cancelled works.
+ *
+ * Nobody but the works of q may queue to q meanwhile.  Must be called from
+ * the main thread, but not from done() of a work of q.
+ */
+int destroy_work_queue(struct work_queue *q, enum work_queue_destroy mode,
+		       struct list_head *cancelled)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+	int nr = 0;
+
+	if (mode == WORK_QUEUE_CANCEL && !cancelled) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (mode == WORK_QUEUE_DRAIN)
+		wq_drain(wi);
+	wq_stop_workers(wi);
+
+	/* the works which were running */
+	wq_run_done(wi);
+	if (mode == WORK_QUEUE_CANCEL)
+		nr = wq_cancel_pending(wi, cancelled);
+	assert(uatomic_read(&wi->nr_queued_work) == 0);
+
+	bs_mutex_lock(&wq_table_lock);
+	list_del(&wi->list);
+	bs_mutex_unlock(&wq_table_lock);
+	uatomic_and(&wq_dirty[wi->idx / BITS_PER_LONG],
+		    ~(1UL << (wi->idx % BITS_PER_LONG)));
+
+	bs_debug("destroy work queue %s, %d cancelled", wi->name, nr);
+	free_wq_info(wi);
+
+	return nr;
+}
+
+/* The NUMA node the works of q should be allocated from, or -1 */
+int get_work_queue_node(struct work_queue *q)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+
+	return wi->attr.numa_node;
+}
+
 bool work_queue_empty(struct work_queue *q)
 {
 	struct wq_info *wi = container_of(q, struct wq_info, q);
 
 	return uatomic_read(&wi->nr_queued_work) == 0;
 }
+
+/*
+ * Per queue instrumentation
+ *
+ * While disabled, queueing and running a work only pay for testing a flag
+ * and clearing its timestamps.  Statistics collected so far are kept when
+ * it is disabled again, and utilization is measured over the time it was
+ * last enabled.
+ */
+void enable_work_queue_stats(struct work_queue *q, bool enable)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+
+	if (enable)
+		uatomic_set(&wi->tm_stats_enabled, get_nsec_time());
+	else
+		uatomic_set(&wi->tm_stats_disabled, get_nsec_time());
+	uatomic_set(&wi->stats_enabled, enable);
+}
+
+/*
+ * Take a snapshot of the statistics of q.  Cheap enough to be polled from
+ * any thread; the histograms are copied without stopping the workers and
+ * may be slightly torn.  The caller frees stats->threads.
+ */
+int get_work_queue_stats(struct work_queue *q, struct work_queue_stats *stats)
+{
+	struct wq_info *wi = container_of(q, struct wq_info, q);
+	struct work_thread_stats *ts;
+	struct wq_thread *th;
+	uint64_t since, until;
+	int nr = 0, size = 0;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->nr_done = uatomic_read(&wi->nr_done);
+	stats->depth = uatomic_read(&wi->nr_queued_work);
+	stats->max_depth = uatomic_read(&wi->max_depth);
+	stats->nr_threads = uatomic_read(&wi->nr_threads);
+	stats->done = wi->done_hist;
+
+	until = uatomic_read(&wi->stats_enabled) ? get_nsec_time() :
+		uatomic_read(&wi->tm_stats_disabled);
+
+	bs_mutex_lock(&wi->stats_lock);
+	stats->wait = wi->exited_wait;
+	stats->run = wi->exited_run;
+	list_for_each_entry(th, &wi->threads, list) {
+		hist_merge(&stats->wait, &th->wait);
+		hist_merge(&stats->run, &th->run);
+
+		if (nr == size) {
+			size = size ? size * 2 : 16;
+			stats->threads = xrealloc(stats->threads,
+						  size * sizeof(*ts));
+		}
+		ts = &stats->threads[nr++];
+		ts->tid = th->tid;
+		ts->nr_works = uatomic_read(&th->nr_works);
+		ts->busy = uatomic_read(&th->busy);
+		since = max(th->tm_started, uatomic_read(&wi->tm_stats_enabled));
+		ts->elapsed = until > since ? until - since : 0;
+	}
+	bs_mutex_unlock(&wi->stats_lock);
+	stats->nr_thread_stats = nr;
+
+	return 0;
+}
+
+/* Write the statistics of all work queues as text to fd */
+int dump_work_queue_stats(int fd)
+{
+	struct work_queue_stats st;
+	struct wq_info *wi;
+	FILE *fp;
+	int i;
+
+	fp = fdopen(dup(fd), "w");
+	if (!fp)
+		return -1;
+
+	bs_mutex_lock(&wq_table_lock);
+	list_for_each_entry(wi, &wq_info_list, list) {
+		get_work_queue_stats(&wi->q, &st);
+		fprintf(fp, "work queue %s done %" PRIu64 " depth %zu"
+			" max_depth %zu threads %zu\n", wi->name, st.nr_done,
+			st.depth, st.max_depth, st.nr_threads);
+		hist_dump(fp, "  wait ns", &st.wait);
+		hist_dump(fp, "  run ns", &st.run);
+		hist_dump(fp, "  done ns", &st.done);
+		for (i = 0; i < st.nr_thread_stats; i++)
+			fprintf(fp, "  thread %d works %" PRIu64
+				" busy %" PRIu64 "%%\n", st.threads[i].tid,
+				st.threads[i].nr_works,
+				st.threads[i].elapsed ? st.threads[i].busy *
+				100 / st.threads[i].elapsed : 0);
+		free(st.threads);
+	}
+	bs_mutex_unlock(&wq_table_lock);
+
+	return fclose(fp);
+}
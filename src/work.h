@@ -2,23 +2,88 @@
 #define __WORK_H__
 
 #include <stdbool.h>
+#include <sched.h>
 
 #include "list.h"
 #include "util.h"
+#include "histogram.h"
 
 struct work;
 
 typedef void (*work_func_t)(struct work *);
+typedef void (*work_batch_func_t)(struct work **works, int nr);
 
 struct work {
 	struct list_node w_list;
 	work_func_t fn;
 	work_func_t done;
+
+	/* private, see enable_work_queue_stats() */
+	uint64_t tm_queued;
+	uint64_t tm_finished;
 };
 
 struct work_queue {
 	int wq_state;
-	struct list_head pending_list;
+};
+
+/* priority levels of a work queue, see queue_work_prio() */
+enum work_prio {
+	WORK_PRIO_HIGH,
+	WORK_PRIO_NORMAL,
+	WORK_PRIO_LOW,
+	WORK_NR_PRIO,
+};
+
+/* how workers pick the next level to serve */
+enum work_prio_policy {
+	WORK_PRIO_STRICT,	/* the highest non-empty level first */
+	WORK_PRIO_WEIGHTED,	/* each level in proportion to its weight */
+};
+
+struct work_prio_stats {
+	uint64_t nr_queued;	/* works queued at the level so far */
+	uint64_t nr_run;	/* works taken from it by the workers */
+	uint64_t nr_pending;	/* works waiting at it now */
+};
+
+/*
+ * Placement and scheduling of the worker threads of a queue, see
+ * init_work_queue_attr() for the defaults
+ */
+struct work_queue_attr {
+	cpu_set_t cpuset;	/* CPUs to run on, any if empty */
+	int numa_node;		/* node to run on and allocate from, -1 for any */
+	int sched_policy;	/* SCHED_OTHER, SCHED_FIFO, ... */
+	int sched_priority;
+	size_t stack_size;	/* 0 for the default */
+};
+
+/* what destroy_work_queue() does with the works not started yet */
+enum work_queue_destroy {
+	WORK_QUEUE_DRAIN,	/* run them to completion */
+	WORK_QUEUE_CANCEL,	/* hand them back to the caller */
+};
+
+struct work_thread_stats {
+	pid_t tid;
+	uint64_t nr_works;	/* works run while enabled */
+	uint64_t busy;		/* ns spent in fn() while enabled */
+	uint64_t elapsed;	/* ns alive while enabled */
+};
+
+/* Times are in nanoseconds of CLOCK_MONOTONIC_RAW */
+struct work_queue_stats {
+	uint64_t nr_done;	/* works done() while enabled */
+	size_t depth;		/* works queued and not done() yet */
+	size_t max_depth;	/* high-water mark of depth while enabled */
+	size_t nr_threads;
+	struct histogram wait;	/* from queueing to the start of fn() */
+	struct histogram run;	/* in fn() */
+	struct histogram done;	/* from the end of fn() to done() */
+	/* one per live worker thread, the caller frees it */
+	int nr_thread_stats;
+	struct work_thread_stats *threads;
 };
 
 static inline bool is_main_thread(void)
@@ -32,10 +97,34 @@ static inline bool is_worker_thread(void)
 }
 
 int init_work_queue(void);
-struct work_queue *create_work_queue(const char *name);
+void init_work_queue_attr(struct work_queue_attr *attr);
+struct work_queue *create_work_queue(const char *name,
+				     const struct work_queue_attr *attr);
+struct work_queue *create_stealing_work_queue(const char *name,
+					      size_t nr_threads,
+					      const struct work_queue_attr *attr);
+int get_work_queue_node(struct work_queue *q);
+int set_work_queue_threads(struct work_queue *q, size_t min_threads,
+			   size_t max_threads);
 void queue_work(struct work_queue *q, struct work *work);
+void queue_work_batch(struct work_queue *q, struct work **works, int nr);
+void set_work_queue_done_batch(struct work_queue *q,
+			       work_batch_func_t done_batch);
+void queue_work_prio(struct work_queue *q, struct work *work,
+		     enum work_prio prio);
+void queue_work_keyed(struct work_queue *q, struct work *work, uint64_t key);
 void queue_work_first_entry(struct work_queue *q, struct work *work);
+int set_work_queue_prio_policy(struct work_queue *q,
+			       enum work_prio_policy policy,
+			       const unsigned int *weights);
+int get_work_queue_prio_stats(struct work_queue *q, enum work_prio prio,
+			      struct work_prio_stats *stats);
 #define emerge_work		queue_work_first_entry
 bool work_queue_empty(struct work_queue *q);
+int destroy_work_queue(struct work_queue *q, enum work_queue_destroy mode,
+		       struct list_head *cancelled);
+void enable_work_queue_stats(struct work_queue *q, bool enable);
+int get_work_queue_stats(struct work_queue *q, struct work_queue_stats *stats);
+int dump_work_queue_stats(int fd);
 
 #endif